@@ -1,38 +1,59 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits>
+#if defined(RENDER_STATS)
+#include <chrono>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+#endif
 
-//ベクトルを定義
-struct Vec
+//ベクトル・光線・球体の計算に使う浮動小数点型
+//既定は速いfloat、-DRENDER_DOUBLEでビルドすると参照用のdouble
+#if defined(RENDER_DOUBLE)
+typedef double Real;
+#else
+typedef float Real;
+#endif
+#define OFFSET_ULPS 8 //反射した光線の始点を面から浮かせる距離(球体の半径に対する丸め誤差の何倍か)
+
+//ベクトルを定義(成分の型Tはfloatかdouble)
+template <class T>
+struct VecT
 {
   //三次元
-  double x, y, z;
+  T x, y, z;
   //コンストラクタ(初期化)
-  Vec(double x_ = 0, double y_ = 0, double z_ = 0)
+  VecT(T x_ = 0, T y_ = 0, T z_ = 0)
   {
     x = x_;
     y = y_;
     z = z_;
   }
   //オペレータ(ベクトル演算を可能にする)
-  Vec operator+(const Vec &b) const { return Vec(x + b.x, y + b.y, z + b.z); }
-  Vec operator-(const Vec &b) const { return Vec(x - b.x, y - b.y, z - b.z); }
-  Vec operator*(double b) const { return Vec(x * b, y * b, z * b); }
-  Vec mult(const Vec &b) const { return Vec(x * b.x, y * b.y, z * b.z); }
-  Vec &norm() { return *this = *this * (1 / sqrt(x * x + y * y + z * z)); }
-  double dot(const Vec &b) const { return x * b.x + y * b.y + z * b.z; } // cross:
-  Vec operator%(Vec &b) { return Vec(y * b.z - z * b.y, z * b.x - x * b.z, x * b.y - y * b.x); }
+  VecT operator+(const VecT &b) const { return VecT(x + b.x, y + b.y, z + b.z); }
+  VecT operator-(const VecT &b) const { return VecT(x - b.x, y - b.y, z - b.z); }
+  VecT operator*(T b) const { return VecT(x * b, y * b, z * b); }
+  VecT mult(const VecT &b) const { return VecT(x * b.x, y * b.y, z * b.z); }
+  VecT &norm() { return *this = *this * (1 / sqrt(x * x + y * y + z * z)); }
+  T dot(const VecT &b) const { return x * b.x + y * b.y + z * b.z; } // cross:
+  VecT operator%(VecT &b) { return VecT(y * b.z - z * b.y, z * b.x - x * b.z, x * b.y - y * b.x); }
 };
+typedef VecT<Real> Vec;
 
 //光線を定義
-struct Ray
+template <class T>
+struct RayT
 {
   //oは開始位置origin
   //dは方向direction
-  Vec o, d;
+  VecT<T> o, d;
   //初期化(コンストラクタ)
-  Ray(Vec o_, Vec d_) : o(o_), d(d_) {}
+  RayT(VecT<T> o_, VecT<T> d_) : o(o_), d(d_) {}
 };
+typedef RayT<Real> Ray;
 
 //表面の反射タイプを設定
 enum Refl_t
@@ -43,18 +64,22 @@ enum Refl_t
 }; // material types, used in radiance()
 
 //球体の定義
-struct Sphere
+template <class T>
+struct SphereT
 {
-  double rad;  // 半径：radius
-  Vec p, e, c; // 座標：position, 発光：emission, 色：color
-  Refl_t refl; // 反射タイプ：reflection type (DIFFuse, SPECular, REFRactive)
+  T rad;           // 半径：radius
+  VecT<T> p, e, c; // 座標：position, 発光：emission, 色：color
+  Refl_t refl;     // 反射タイプ：reflection type (DIFFuse, SPECular, REFRactive)
   //初期化(コンストラクタ)
-  Sphere(double rad_, Vec p_, Vec e_, Vec c_, Refl_t refl_) : rad(rad_), p(p_), e(e_), c(c_), refl(refl_) {}
+  SphereT(T rad_, VecT<T> p_, VecT<T> e_, VecT<T> c_, Refl_t refl_) : rad(rad_), p(p_), e(e_), c(c_), refl(refl_) {}
   //交差判定関数
-  double intersect(const Ray &r) const
-  {                   // returns distance, 0 if nohit
-    Vec op = p - r.o; // Solve t^2*d.d + 2*t*(o-p).d + (o-p).(o-p)-R^2 = 0
-    double t, eps = 1e-4, b = op.dot(r.d), det = b * b - op.dot(op) + rad * rad;
+  //判別式は中心から光線までの垂線(l)で求める(b*b-op.op+R^2だと半径1e5の壁で桁落ちしfloatでは使えない)
+  T intersect(const RayT<T> &r) const
+  {                       // returns distance, 0 if nohit
+    VecT<T> op = p - r.o; // Solve t^2*d.d + 2*t*(o-p).d + (o-p).(o-p)-R^2 = 0
+    T b = op.dot(r.d);
+    VecT<T> l = op - r.d * b;
+    T t, eps = 1e-4, det = rad * rad - l.dot(l);
     if (det < 0)
       return 0;
     else
@@ -62,6 +87,7 @@ struct Sphere
     return (t = b - det) > eps ? t : ((t = b + det) > eps ? t : 0);
   }
 };
+typedef SphereT<Real> Sphere;
 
 //球体群の定義
 Sphere spheres[] = {
@@ -81,11 +107,42 @@ Sphere spheres[] = {
     Sphere(600, Vec(50, 681.6 - .27, 81.6), Vec(12, 12, 12), Vec(), DIFF) //Lite
 };
 
+//描画統計(-DRENDER_STATSでビルドした場合だけ数え、終了時に標準エラーへ表を出す)
+//各スレッドは自分の分(threadprivate)だけを書き換え、最後に合計する
+#if defined(RENDER_STATS)
+#define STATS_DEPTH 16 //反射回数ごとに光線を数える深さの上限
+struct Stats
+{
+  long rays[STATS_DEPTH]; // 反射回数ごとの光線数(最後は上限以上の合計)
+  long tests;             // 球体との交差判定の回数
+  long hits[3];           // 反射タイプごとの交差数
+  long roulette;          // ロシアンルーレットで打ち切った経路数
+  long rows;              // 描画した行数
+  double seconds;         // 行の描画にかかった時間
+};
+static Stats stats;
+#pragma omp threadprivate(stats)
+#define STATS_ADD(field, value) (stats.field += (value))
+inline double statsNow() { return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+#else
+#define STATS_ADD(field, value) ((void)0)
+#endif
+
 inline double clamp(double x) { return x < 0 ? 0 : x > 1 ? 1 : x; }
 inline int toInt(double x) { return int(pow(clamp(x), 1 / 2.2) * 255 + .5); }
-inline bool intersect(const Ray &r, double &t, int &id)
+//ピクセル(x,y)の乱数の種を設定する(SplitMix64でハッシュするので隣接ピクセル間の相関がなく、描画順にも依存しない)
+inline void seedPixel(unsigned short *Xi, int x, int y)
 {
-  double n = sizeof(spheres) / sizeof(Sphere), d, inf = t = 1e20;
+  uint64_t h = ((uint64_t)(uint32_t)y << 32 | (uint32_t)x) + 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  Xi[0] = (unsigned short)h, Xi[1] = (unsigned short)(h >> 16), Xi[2] = (unsigned short)(h >> 32);
+}
+inline bool intersect(const Ray &r, Real &t, int &id)
+{
+  Real n = sizeof(spheres) / sizeof(Sphere), d, inf = t = 1e20;
+  STATS_ADD(tests, (long)n);
   for (int i = int(n); i--;)
     if ((d = spheres[i].intersect(r)) && d < t)
     {
@@ -94,54 +151,144 @@ inline bool intersect(const Ray &r, double &t, int &id)
     }
   return t < inf;
 }
-Vec radiance(const Ray &r, int depth, unsigned short *Xi)
+//点xから球体sを見込む円錐の中で一様に方向を選ぶ(立体角サンプリング)ときの確率密度(xが球体の内側なら0)
+inline Real lightPdf(const Vec &x, const Sphere &s, Real &oneMinusCos)
+{
+  Vec sx = s.p - x;
+  Real sin2 = s.rad * s.rad / sx.dot(sx);
+  if (sin2 >= 1)
+    return 0;
+  oneMinusCos = sin2 / (1 + sqrt(1 - sin2)); // 1-cos(円錐の半頂角)を遠くの小さな光源でも桁落ちしない形で
+  return 1 / (2 * M_PI * oneMinusCos);
+}
+//MISのパワーヒューリスティック(β=2)
+inline Real powerHeuristic(Real pdf, Real otherPdf) { return pdf * pdf / (pdf * pdf + otherPdf * otherPdf); }
+//拡散面の点x(法線nl)から光る球体をそれぞれ立体角サンプリングし、遮られずに届く光を返す(次イベント推定)
+//反射方向のサンプリング(確率密度cos/π)で同じ光源に当たる場合とMISで重み付けする。反射率は掛ける前
+Vec sampleLights(const Vec &x, const Vec &nl, unsigned short *Xi)
 {
-  double t;   // distance to intersection
+  Vec e;
+  for (int i = 0; i < int(sizeof(spheres) / sizeof(Sphere)); i++)
+  {
+    const Sphere &s = spheres[i];
+    Real oneMinusCos, pdf;
+    if ((s.e.x <= 0 && s.e.y <= 0 && s.e.z <= 0) || (pdf = lightPdf(x, s, oneMinusCos)) <= 0)
+      continue;
+    Vec sw = (s.p - x).norm(), su = ((fabs(sw.x) > .1 ? Vec(0, 1) : Vec(1)) % sw).norm(), sv = sw % su;
+    Real cos_a = 1 - erand48(Xi) * oneMinusCos, sin_a = sqrt(1 - cos_a * cos_a), phi = 2 * M_PI * erand48(Xi);
+    Vec l = su * cos(phi) * sin_a + sv * sin(phi) * sin_a + sw * cos_a;
+    Real cosN = l.dot(nl), t;
+    int id = -1;
+    if (cosN > 0 && intersect(Ray(x, l), t, id) && id == i)
+      e = e + s.e * (cosN / M_PI / pdf * powerHeuristic(pdf, cosN / M_PI));
+  }
+  return e;
+}
+//再帰せずに経路の重み(cf)と蓄積した輝度(cl)を更新しながら反射を繰り返す
+//屈折で反射と透過の両方を辿る分岐はせず、常にロシアンルーレットでどちらか一方を選ぶ
+//lightSamplingなら拡散面で光源を直接サンプリングし、反射方向で光源に当たった場合はMISの重みを掛ける
+Vec radiance(const Ray &r_, int maxDepth, bool lightSampling, unsigned short *Xi)
+{
+  Real t;     // distance to intersection
   int id = 0; // id of intersected object
-  if (!intersect(r, t, id))
-    return Vec();                  // if miss, return black
-  const Sphere &obj = spheres[id]; // the hit object
-  Vec x = r.o + r.d * t, n = (x - obj.p).norm(), nl = n.dot(r.d) < 0 ? n : n * -1, f = obj.c;
-  double p = f.x > f.y && f.x > f.z ? f.x : f.y > f.z ? f.y : f.z; // max refl
-  if (++depth > 5)
-    if (erand48(Xi) < p)
-      f = f * (1 / p);
+  Ray r = r_;
+  Vec cl(0, 0, 0); // accumulated color
+  Vec cf(1, 1, 1); // accumulated reflectance
+  Vec lastX;       // 直前の拡散反射の位置
+  Real lastPdf = 0; // 直前の拡散反射で方向を選んだ確率密度(0ならカメラか鏡面・屈折で、MISの重みを掛けない)
+  for (int depth = 0;;)
+  {
+    STATS_ADD(rays[depth < STATS_DEPTH ? depth : STATS_DEPTH - 1], 1);
+    if (!intersect(r, t, id))
+      return cl;                     // if miss, return accumulated color
+    const Sphere &obj = spheres[id]; // the hit object
+    STATS_ADD(hits[obj.refl], 1);
+    Vec x = r.o + r.d * t, n = (x - obj.p).norm(), nl = n.dot(r.d) < 0 ? n : n * -1, f = obj.c;
+    //次の光線の始点を面から少し浮かせる(巨大な球体ほど座標の丸め誤差が大きいので半径に比例させる)
+    Real offset = obj.rad * OFFSET_ULPS * std::numeric_limits<Real>::epsilon();
+    Vec above = x + nl * offset, below = x - nl * offset;
+    Real p = f.x > f.y && f.x > f.z ? f.x : f.y > f.z ? f.y : f.z; // max refl
+    Vec e = obj.e;
+    if (lastPdf > 0 && (e.x > 0 || e.y > 0 || e.z > 0))
+    {
+      Real oneMinusCos, pdf = lightPdf(lastX, obj, oneMinusCos);
+      e = e * powerHeuristic(lastPdf, pdf);
+    }
+    cl = cl + cf.mult(e);
+    if (++depth > 5)
+    {
+      if (erand48(Xi) < p)
+        f = f * (1 / p);
+      else
+      {
+        STATS_ADD(roulette, 1);
+        return cl; //R.R.
+      }
+    }
+    if (maxDepth > 0 && depth >= maxDepth)
+      return cl;
+    cf = cf.mult(f);
+    if (obj.refl == DIFF)
+    { // Ideal DIFFUSE reflection
+      if (lightSampling)
+        cl = cl + cf.mult(sampleLights(above, nl, Xi));
+      Real r1 = 2 * M_PI * erand48(Xi), r2 = erand48(Xi), r2s = sqrt(r2);
+      Vec w = nl, u = ((fabs(w.x) > .1 ? Vec(0, 1) : Vec(1)) % w).norm(), v = w % u;
+      Vec d = (u * cos(r1) * r2s + v * sin(r1) * r2s + w * sqrt(1 - r2)).norm();
+      r = Ray(above, d);
+      lastX = x;
+      lastPdf = lightSampling ? d.dot(nl) / M_PI : 0;
+      continue;
+    }
+    lastPdf = 0;
+    if (obj.refl == SPEC)
+    { // Ideal SPECULAR reflection
+      r = Ray(above, r.d - n * 2 * n.dot(r.d));
+      continue;
+    }
+    Ray reflRay(above, r.d - n * 2 * n.dot(r.d)); // Ideal dielectric REFRACTION
+    bool into = n.dot(nl) > 0;                // Ray from outside going in?
+    Real nc = 1, nt = 1.5, nnt = into ? nc / nt : nt / nc, ddn = r.d.dot(nl), cos2t;
+    if ((cos2t = 1 - nnt * nnt * (1 - ddn * ddn)) < 0)
+    { // Total internal reflection
+      r = reflRay;
+      continue;
+    }
+    Vec tdir = (r.d * nnt - n * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).norm();
+    Real a = nt - nc, b = nt + nc, R0 = a * a / (b * b), c = 1 - (into ? -ddn : tdir.dot(n));
+    Real Re = R0 + (1 - R0) * c * c * c * c * c, Tr = 1 - Re, P = .25 + .5 * Re, RP = Re / P, TP = Tr / (1 - P);
+    if (erand48(Xi) < P)
+    { // Russian roulette
+      cf = cf * RP;
+      r = reflRay;
+    }
     else
-      return obj.e; //R.R.
-  if (obj.refl == DIFF)
-  { // Ideal DIFFUSE reflection
-    double r1 = 2 * M_PI * erand48(Xi), r2 = erand48(Xi), r2s = sqrt(r2);
-    Vec w = nl, u = ((fabs(w.x) > .1 ? Vec(0, 1) : Vec(1)) % w).norm(), v = w % u;
-    Vec d = (u * cos(r1) * r2s + v * sin(r1) * r2s + w * sqrt(1 - r2)).norm();
-    return obj.e + f.mult(radiance(Ray(x, d), depth, Xi));
+    {
+      cf = cf * TP;
+      r = Ray(below, tdir);
+    }
   }
-  else if (obj.refl == SPEC) // Ideal SPECULAR reflection
-    return obj.e + f.mult(radiance(Ray(x, r.d - n * 2 * n.dot(r.d)), depth, Xi));
-  Ray reflRay(x, r.d - n * 2 * n.dot(r.d)); // Ideal dielectric REFRACTION
-  bool into = n.dot(nl) > 0;                // Ray from outside going in?
-  double nc = 1, nt = 1.5, nnt = into ? nc / nt : nt / nc, ddn = r.d.dot(nl), cos2t;
-  if ((cos2t = 1 - nnt * nnt * (1 - ddn * ddn)) < 0) // Total internal reflection
-    return obj.e + f.mult(radiance(reflRay, depth, Xi));
-  Vec tdir = (r.d * nnt - n * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).norm();
-  double a = nt - nc, b = nt + nc, R0 = a * a / (b * b), c = 1 - (into ? -ddn : tdir.dot(n));
-  double Re = R0 + (1 - R0) * c * c * c * c * c, Tr = 1 - Re, P = .25 + .5 * Re, RP = Re / P, TP = Tr / (1 - P);
-  return obj.e + f.mult(depth > 2 ? (erand48(Xi) < P ? // Russian roulette
-                                         radiance(reflRay, depth, Xi) * RP
-                                                     : radiance(Ray(x, tdir), depth, Xi) * TP)
-                                  : radiance(reflRay, depth, Xi) * Re + radiance(Ray(x, tdir), depth, Xi) * Tr);
 }
 
 int main(int argc, char *argv[])
 {
-  int w = 1024, h = 768, samps = argc == 2 ? atoi(argv[1]) / 4 : 1; // # samples
+  int w = 1024, h = 768, samps = argc >= 2 ? atoi(argv[1]) / 4 : 1; // # samples
+  int maxDepth = argc >= 3 ? atoi(argv[2]) : 0;                      // max bounces (0: Russian roulette only)
+  bool lightSampling = argc >= 4 ? atoi(argv[3]) != 0 : true;        // 光源サンプリング(0: 反射方向のサンプリングのみ)
   Ray cam(Vec(50, 52, 295.6), Vec(0, -0.042612, -1).norm());        // cam pos, dir
   Vec cx = Vec(w * .5135 / h), cy = (cx % cam.d).norm() * .5135, r, *c = new Vec[w * h];
+#if defined(RENDER_STATS)
+  double renderStart = statsNow();
+#endif
 #pragma omp parallel for schedule(dynamic, 1) private(r) // OpenMP
   for (int y = 0; y < h; y++)
   { // Loop over image rows
     fprintf(stderr, "\rRendering (%d spp) %5.2f%%", samps * 4, 100. * y / (h - 1));
-    for (unsigned short x = 0, Xi[3] = {0, 0, y * y * y}; x < w; x++) // Loop cols
-      for (int sy = 0, i = (h - y - 1) * w + x; sy < 2; sy++)         // 2x2 subpixel rows
+#if defined(RENDER_STATS)
+    double rowStart = statsNow();
+#endif
+    for (unsigned short x = 0, Xi[3]; x < w; x++) // Loop cols
+      for (int sy = (seedPixel(Xi, x, y), 0), i = (h - y - 1) * w + x; sy < 2; sy++) // 2x2 subpixel rows
         for (int sx = 0; sx < 2; sx++, r = Vec())
         { // 2x2 subpixel cols
           for (int s = 0; s < samps; s++)
@@ -150,13 +297,46 @@ int main(int argc, char *argv[])
             double r2 = 2 * erand48(Xi), dy = r2 < 1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
             Vec d = cx * (((sx + .5 + dx) / 2 + x) / w - .5) +
                     cy * (((sy + .5 + dy) / 2 + y) / h - .5) + cam.d;
-            r = r + radiance(Ray(cam.o + d * 140, d.norm()), 0, Xi) * (1. / samps);
+            r = r + radiance(Ray(cam.o + d * 140, d.norm()), maxDepth, lightSampling, Xi) * (1. / samps);
           } // Camera rays are pushed ^^^^^ forward to start in interior
           c[i] = c[i] + Vec(clamp(r.x), clamp(r.y), clamp(r.z)) * .25;
         }
+#if defined(RENDER_STATS)
+    STATS_ADD(rows, 1);
+    STATS_ADD(seconds, statsNow() - rowStart);
+#endif
   }
+#if defined(RENDER_STATS)
+  double writeStart = statsNow();
+#endif
   FILE *f = fopen("image.ppm", "w"); // Write image to PPM file.
   fprintf(f, "P3\n%d %d\n%d\n", w, h, 255);
   for (int i = 0; i < w * h; i++)
     fprintf(f, "%d %d %d ", toInt(c[i].x), toInt(c[i].y), toInt(c[i].z));
+#if defined(RENDER_STATS)
+  fclose(f);
+  fprintf(stderr, "\n%-24s %16.3f\n%-24s %16.3f\n", "render [s]", writeStart - renderStart, "write [s]", statsNow() - writeStart);
+  //各スレッドの統計を合計する
+  Stats total = Stats();
+#pragma omp parallel
+  {
+#pragma omp critical
+    {
+#if defined(_OPENMP)
+      fprintf(stderr, "thread %-17d %10ld rows %10.3f s\n", omp_get_thread_num(), stats.rows, stats.seconds);
+#endif
+      for (int d = 0; d < STATS_DEPTH; d++)
+        total.rays[d] += stats.rays[d];
+      total.tests += stats.tests;
+      for (int k = 0; k < 3; k++)
+        total.hits[k] += stats.hits[k];
+      total.roulette += stats.roulette;
+    }
+  }
+  for (int d = 0; d < STATS_DEPTH; d++)
+    if (total.rays[d] > 0)
+      fprintf(stderr, "rays at depth %-10d %16ld\n", d, total.rays[d]);
+  fprintf(stderr, "%-24s %16ld\n%-24s %16ld\n%-24s %16ld\n%-24s %16ld\n%-24s %16ld\n", "sphere tests", total.tests,
+          "hits diffuse", total.hits[DIFF], "hits specular", total.hits[SPEC], "hits refraction", total.hits[REFR], "roulette terminations", total.roulette);
+#endif
 }
@@ -1,28 +1,336 @@
-#include <stdlib.h> // Make : g++ -O3 -fopenmp smallpt.cpp -o smallpt
-#include <stdio.h>  //        Remove "-fopenmp" for g++ version < 4.2
+#include <stdlib.h> // Make : g++ -O3 -march=native -pthread raytrace.cpp -o raytrace
+#include <stdio.h>
 #include <string>
 #include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#include <memory>
+#include <dirent.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
-#define WIDTH 400        //横のピクセル数
-#define HEIGHT 300       //縦のピクセル数
-#define SAMPLING_SIZE 10 //サンプリング数
-#define GROSS 255        //輝度の階級
-#define PI 3.14159       //円周率
+#define GROSS 255  //輝度の階級
+#define PI 3.14159 //円周率
 //#define INFINITY 1000          //無限大
-#define MAX_REFLECTSION_SIZE 4 //最大反射回数
+#define TILE_SIZE 16           //タイルの一辺のピクセル数
+#define WAVEFRONT_SIZE 4096    //ウェーブフロント描画で同時に追跡する経路の最大数
+#define RAY_BIN_BITS 4         //二次光線の並べ替えで始点のセルを分ける軸ごとのビット数
+#define RENDER_STATS_DEPTH 16  //描画統計で反射回数ごとに光線を数える深さの上限
+#define BVH_BIN_SIZE 16        //SAH評価に使うビンの数
+#define BVH_MAX_LEAF_SIZE 8    //BVHの葉に入れる最大プリミティブ数
+#define BVH_STACK_SIZE 64      //BVH走査スタックの深さ
+#define BVH_TRAVERSAL_COST 1.0 //SAHでのノード走査コスト(球体の一括判定1回を1とする)
+
+//球体の一括交差判定で同時に扱う数
+#if defined(__AVX__)
+#define SPHERE_SIMD_WIDTH 8
+#elif defined(__SSE2__)
+#define SPHERE_SIMD_WIDTH 4
+#else
+#define SPHERE_SIMD_WIDTH 1
+#endif
+
+//SIMD用にアライメントを揃えて確保するアロケータ
+template <class T, size_t Alignment = 32>
+struct AlignedAllocator
+{
+    typedef T value_type;
+    AlignedAllocator() {}
+    template <class U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+    template <class U>
+    struct rebind
+    {
+        typedef AlignedAllocator<U, Alignment> other;
+    };
+    T *allocate(size_t n)
+    {
+        void *p = NULL;
+        if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0)
+            throw std::bad_alloc();
+        return (T *)p;
+    }
+    void deallocate(T *p, size_t) { free(p); }
+    bool operator==(const AlignedAllocator &) const { return true; }
+    bool operator!=(const AlignedAllocator &) const { return false; }
+};
+
+//乱数生成器(PCG32)
+//状態を持つのはサンプラーごとなので、スレッド間で共有せずロックも不要
+class Random
+{
+public:
+    Random(uint64_t seed = 0, uint64_t stream = 0) { Seed(seed, stream); }
+    //初期状態と系列番号を設定
+    void Seed(uint64_t seed, uint64_t stream)
+    {
+        state = 0;
+        increment = (stream << 1) | 1;
+        NextUInt();
+        state += seed;
+        NextUInt();
+    }
+    //32bitの一様乱数
+    uint32_t NextUInt()
+    {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + increment;
+        uint32_t xorShifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+        uint32_t rot = (uint32_t)(old >> 59);
+        return (xorShifted >> rot) | (xorShifted << ((32 - rot) & 31));
+    }
+    //[0,1)の一様乱数
+    double Next() { return NextUInt() * (1.0 / 4294967296.0); }
+
+private:
+    uint64_t state, increment;
+};
+
+//64bitハッシュ(SplitMix64の最終段)
+inline uint64_t Hash64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+//サンプラー
+//(ピクセル, サンプル番号, フレーム番号)から乱数列を決めるので、スレッド数や描画順に依らず同じ画像になる
+//乱数生成器を差し替える場合はこのクラスだけを変更すればよい
+class Sampler
+{
+public:
+    Sampler(int _frame = 0) { frame = _frame; }
+    //ピクセル(x,y)のn番目のサンプルの乱数列を開始する
+    void StartPixelSample(int x, int y, int n)
+    {
+        uint64_t pixel = ((uint64_t)(uint32_t)y << 32) | (uint32_t)x;
+        uint64_t seed = Hash64(Hash64(pixel) ^ ((uint64_t)(uint32_t)n << 32 | (uint32_t)frame));
+        random.Seed(seed, Hash64(pixel + 1));
+    }
+    //[0,1)の一様乱数を1つ取得
+    double Get1D() { return random.Next(); }
+
+private:
+    Random random;
+    int frame;
+};
+
+//経過時間を計測する
+class Timer
+{
+public:
+    Timer() { Reset(); }
+    void Reset() { start = std::chrono::steady_clock::now(); }
+    //経過秒数
+    double Seconds() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+//描画統計の処理段階
+enum StatsPhase
+{
+    PHASE_SCENE_LOAD,   //シーンファイルの読み込みと加速構造の構築
+    PHASE_TEXTURE_LOAD, //背景画像の読み込み
+    PHASE_RENDER,       //描画
+    PHASE_WRITE,        //画像の書き出し
+    PHASE_COUNT,
+};
+
+//スレッドごとの描画統計(共有の変数を奪い合わないよう、各スレッドは自分の分だけを書き換える)
+struct ThreadStats
+{
+    long raysPerDepth[RENDER_STATS_DEPTH]; //反射回数ごとの交差判定した光線数(最後は上限以上の合計)
+    long nodeVisits;                       //辿ったBVHノード数
+    long sphereTests;                      //交差判定した球体数(SIMDで一括判定したものも1つずつ数える)
+    long triangleTests;                    //交差判定した三角形数
+    long hitsPerType[4];                   //交差したマテリアルの反射タイプごとの数
+    long rouletteTerminations;             //ロシアンルーレットで打ち切った経路数
+
+    ThreadStats() { Clear(); }
+    ~ThreadStats();
+    void Clear()
+    {
+        memset(raysPerDepth, 0, sizeof(raysPerDepth));
+        memset(hitsPerType, 0, sizeof(hitsPerType));
+        nodeVisits = sphereTests = triangleTests = rouletteTerminations = 0;
+    }
+    void Add(const ThreadStats &other)
+    {
+        for (int n = 0; n < RENDER_STATS_DEPTH; n++)
+            raysPerDepth[n] += other.raysPerDepth[n];
+        nodeVisits += other.nodeVisits;
+        sphereTests += other.sphereTests;
+        triangleTests += other.triangleTests;
+        for (int n = 0; n < 4; n++)
+            hitsPerType[n] += other.hitsPerType[n];
+        rouletteTerminations += other.rouletteTerminations;
+    }
+};
+
+//描画統計の集計(-DRENDER_STATSでビルドした場合だけ数える)
+//各スレッドの統計はスレッドの終了時に合計へ足し込む
+class RenderStats
+{
+public:
+    RenderStats() { memset(phaseSeconds, 0, sizeof(phaseSeconds)); }
+    //このスレッドの統計
+    static ThreadStats &Local()
+    {
+        static thread_local ThreadStats local;
+        return local;
+    }
+    void Merge(ThreadStats &stats)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        total.Add(stats);
+        stats.Clear();
+    }
+    void AddPhase(StatsPhase phase, double seconds)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        phaseSeconds[phase] += seconds;
+    }
+    //描画スレッドthreadIndexがtileCount枚のタイルにseconds秒かけたことを記録する
+    void AddTiles(int threadIndex, int tileCount, double seconds)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if ((int)tileSeconds.size() <= threadIndex)
+        {
+            tileSeconds.resize(threadIndex + 1);
+            tileCounts.resize(threadIndex + 1);
+        }
+        tileSeconds[threadIndex] += seconds;
+        tileCounts[threadIndex] += tileCount;
+    }
+    //表にして出力する
+    void Print(FILE *fp)
+    {
+        Merge(Local());
+        std::lock_guard<std::mutex> guard(lock);
+        const char *phaseNames[] = {"scene load", "texture load", "render", "write"};
+        const char *typeNames[] = {"diffuse", "reflection", "refraction", "blinn-phong"};
+        fprintf(fp, "%-24s %16s\n", "phase", "seconds");
+        for (int n = 0; n < PHASE_COUNT; n++)
+            fprintf(fp, "%-24s %16.3f\n", phaseNames[n], phaseSeconds[n]);
+        fprintf(fp, "%-24s %16s\n", "depth", "rays");
+        for (int n = 0; n < RENDER_STATS_DEPTH; n++)
+        {
+            if (total.raysPerDepth[n] > 0)
+                fprintf(fp, "%-24d %16ld\n", n, total.raysPerDepth[n]);
+        }
+        fprintf(fp, "%-24s %16ld\n", "bvh nodes visited", total.nodeVisits);
+        fprintf(fp, "%-24s %16ld\n", "sphere tests", total.sphereTests);
+        fprintf(fp, "%-24s %16ld\n", "triangle tests", total.triangleTests);
+        for (int n = 0; n < 4; n++)
+            fprintf(fp, "hits %-19s %16ld\n", typeNames[n], total.hitsPerType[n]);
+        fprintf(fp, "%-24s %16ld\n", "roulette terminations", total.rouletteTerminations);
+        fprintf(fp, "%-24s %16s %16s\n", "thread", "tiles", "seconds");
+        for (size_t n = 0; n < tileSeconds.size(); n++)
+            fprintf(fp, "%-24d %16ld %16.3f\n", (int)n, tileCounts[n], tileSeconds[n]);
+    }
+    //JSONにして出力する
+    void WriteJson(FILE *fp)
+    {
+        Merge(Local());
+        std::lock_guard<std::mutex> guard(lock);
+        const char *phaseNames[] = {"scene_load", "texture_load", "render", "write"};
+        const char *typeNames[] = {"diffuse", "reflection", "refraction", "blinn_phong"};
+        fprintf(fp, "{\n  \"phase_seconds\": {");
+        for (int n = 0; n < PHASE_COUNT; n++)
+            fprintf(fp, "%s\"%s\": %.6f", n ? ", " : "", phaseNames[n], phaseSeconds[n]);
+        fprintf(fp, "},\n  \"rays_per_depth\": [");
+        for (int n = 0; n < RENDER_STATS_DEPTH; n++)
+            fprintf(fp, "%s%ld", n ? ", " : "", total.raysPerDepth[n]);
+        fprintf(fp, "],\n  \"bvh_nodes_visited\": %ld,\n  \"sphere_tests\": %ld,\n  \"triangle_tests\": %ld,\n  \"hits_per_type\": {", total.nodeVisits, total.sphereTests, total.triangleTests);
+        for (int n = 0; n < 4; n++)
+            fprintf(fp, "%s\"%s\": %ld", n ? ", " : "", typeNames[n], total.hitsPerType[n]);
+        fprintf(fp, "},\n  \"roulette_terminations\": %ld,\n  \"threads\": [", total.rouletteTerminations);
+        for (size_t n = 0; n < tileSeconds.size(); n++)
+            fprintf(fp, "%s{\"tiles\": %ld, \"seconds\": %.6f}", n ? ", " : "", tileCounts[n], tileSeconds[n]);
+        fprintf(fp, "]\n}\n");
+    }
+
+private:
+    std::mutex lock;
+    ThreadStats total;
+    double phaseSeconds[PHASE_COUNT];
+    std::vector<double> tileSeconds;
+    std::vector<long> tileCounts;
+};
+RenderStats renderStats;
+ThreadStats::~ThreadStats()
+{
+    renderStats.Merge(*this);
+}
+
+//処理段階の時間を範囲の終わりで記録する
+class StatsPhaseTimer
+{
+public:
+    StatsPhaseTimer(StatsPhase _phase) : phase(_phase) {}
+    ~StatsPhaseTimer() { renderStats.AddPhase(phase, timer.Seconds()); }
+
+private:
+    StatsPhase phase;
+    Timer timer;
+};
+
+//統計を数えるマクロ(RENDER_STATSを定義しなければ引数も評価されず、何も生成されない)
+#if defined(RENDER_STATS)
+#define STATS_ADD(field, value) (RenderStats::Local().field += (value))
+#define STATS_PHASE(phase) StatsPhaseTimer statsPhaseTimer(phase)
+#else
+#define STATS_ADD(field, value) ((void)0)
+#define STATS_PHASE(phase) ((void)0)
+#endif
+
+//ベクトル・光線・球体の計算に使う浮動小数点型
+//既定は速いfloat(メモリの転送量が半分で、SIMDで同時に扱える数が倍)、-DRENDER_DOUBLEでビルドすると参照用のdouble
+#if defined(RENDER_DOUBLE)
+typedef double Real;
+#else
+typedef float Real;
+#endif
 
 //前方宣言
 class Color;
-//ベクトルの定義
-class Vector3
+//ベクトルの定義(成分の型Tはfloatかdouble)
+template <class T>
+class Vector3T
 {
 public:
     //三次元
-    double x, y, z;
+    T x, y, z;
     //コンストラクタ(初期化)
-    Vector3(double x_ = 0, double y_ = 0, double z_ = 0)
+    Vector3T(T x_ = 0, T y_ = 0, T z_ = 0)
     {
         x = x_;
         y = y_;
@@ -30,70 +338,82 @@ public:
     }
 
     //オペレータ(ベクトル演算を可能にする)
-    Vector3 operator+(const Vector3 &b) const { return Vector3(x + b.x, y + b.y, z + b.z); }
-    Vector3 operator-(const Vector3 &b) const { return Vector3(x - b.x, y - b.y, z - b.z); }
-    Vector3 operator-() const { return Vector3(-x, -y, -z); }
-    Vector3 operator*(double b) const { return Vector3(x * b, y * b, z * b); }
+    Vector3T operator+(const Vector3T &b) const { return Vector3T(x + b.x, y + b.y, z + b.z); }
+    Vector3T operator-(const Vector3T &b) const { return Vector3T(x - b.x, y - b.y, z - b.z); }
+    Vector3T operator-() const { return Vector3T(-x, -y, -z); }
+    Vector3T operator*(T b) const { return Vector3T(x * b, y * b, z * b); }
     //アダマール積
-    Vector3 Mult(const Vector3 &b) const { return Vector3(x * b.x, y * b.y, z * b.z); }
+    Vector3T Mult(const Vector3T &b) const { return Vector3T(x * b.x, y * b.y, z * b.z); }
     //正規化
-    Vector3 &Norm() { return *this = *this * (1 / sqrt(x * x + y * y + z * z)); }
+    Vector3T &Norm() { return *this = *this * (1 / sqrt(x * x + y * y + z * z)); }
     //内積
-    double Dot(const Vector3 &b) const { return x * b.x + y * b.y + z * b.z; }
+    T Dot(const Vector3T &b) const { return x * b.x + y * b.y + z * b.z; }
     //外積
-    Vector3 Cross(Vector3 &b) { return Vector3(y * b.z - z * b.y, z * b.x - x * b.z, x * b.y - y * b.x); }
+    Vector3T Cross(const Vector3T &b) const { return Vector3T(y * b.z - z * b.y, z * b.x - x * b.z, x * b.y - y * b.x); }
     //長さ
-    float Length() { return sqrt(x * x + y * y + z * z); }
+    T Length() const { return sqrt(x * x + y * y + z * z); }
     //表示
     void Print()
     {
-        printf("( %.3f, %.3f, %.3f)\n", x, y, z);
+        printf("( %.3f, %.3f, %.3f)\n", (double)x, (double)y, (double)z);
     }
     //セット
-    Vector3 Set(double x_, double y_, double z_)
+    Vector3T Set(T x_, T y_, T z_)
     {
         x = x_;
         y = y_;
         z = z_;
         return *this;
     }
-    Vector3 Lerp(double t, Vector3 start, Vector3 end)
+    Vector3T Lerp(T t, Vector3T start, Vector3T end)
     {
         return (start - end) * t;
     }
-    Vector3 RandInUnitSphere()
+    Vector3T RandInUnitSphere(Sampler &sampler)
     {
         /*
-        Vector3 P;
-        Vector3 rand(drand48(), drand48(), drand48());
+        Vector3T P;
+        Vector3T rand(drand48(), drand48(), drand48());
         do
         {
-            P = rand * 2 - Vector3(1, 1, 1);
+            P = rand * 2 - Vector3T(1, 1, 1);
         } while (P.Length() >= 1);
         */
-        float thete = drand48() * 2 * PI;
-        float u = drand48();
-        float A = sqrt(1 - u);
-        return Vector3(A * cos(thete), A * sin(thete), sqrt(u));
+        T thete = sampler.Get1D() * 2 * PI;
+        T u = sampler.Get1D();
+        T A = sqrt(1 - u);
+        return Vector3T(A * cos(thete), A * sin(thete), sqrt(u));
+    }
+    //単位球面上の一様な点(法線に足すと、法線を軸にした余弦分布の方向になる)
+    static Vector3T RandOnUnitSphere(Sampler &sampler)
+    {
+        T z = 1 - 2 * sampler.Get1D();
+        T phi = sampler.Get1D() * 2 * PI;
+        T r = sqrt(std::max((T)0, 1 - z * z));
+        return Vector3T(r * cos(phi), r * sin(phi), z);
     }
     //カラー型に変換
-    Color ToColor();
+    Color ToColor() const;
 };
+typedef Vector3T<Real> Vector3;
 
+//カラー(線形な輝度、1.0が8bitの最大輝度GROSSに相当。上限なし)
 class Color
 {
 public:
-    int r, g, b;
+    float r, g, b;
     Color() {} //クラスでの宣言で必要
     //基本はこちらを使用
-    Color(int _r, int _g, int _b)
+    Color(float _r, float _g, float _b)
     {
         r = _r;
         g = _g;
         b = _b;
     }
+    //8bitの値(0~GROSS)から作成
+    static Color FromByte(int _r, int _g, int _b) { return Color(_r / (float)GROSS, _g / (float)GROSS, _b / (float)GROSS); }
 
-    void Set(int _r, int _g, int _b)
+    void Set(float _r, float _g, float _b)
     {
         r = _r;
         g = _g;
@@ -105,752 +425,5171 @@ public:
         v.Norm();
         //虹色に色付けする
         Vector3 colorVector = (v + Vector3(1, 1, 1)) * 0.5;
-        r = (int)(GROSS * colorVector.x);
-        g = (int)(GROSS * colorVector.y);
-        b = (int)(GROSS * colorVector.z);
-        return Color(r, g, b);
-    }
-    //加算
-    Color operator+(const Color &left) const
-    {
-        int R = r + left.r;
-        int G = g + left.g;
-        int B = b + left.b;
-        if (R > GROSS)
-            R = GROSS;
-        if (G > GROSS)
-            G = GROSS;
-        if (B > GROSS)
-            B = GROSS;
-        return Color(R, G, B);
+        Set(colorVector.x, colorVector.y, colorVector.z);
+        return *this;
     }
+    //加算(エネルギーを失わないよう上限で切らない)
+    Color operator+(const Color &left) const { return Color(r + left.r, g + left.g, b + left.b); }
     //減算
     Color operator-(const Color &left) const
     {
-        int R = r - left.r;
-        int G = g - left.g;
-        int B = b - left.b;
-        if (R < 0)
-            R = 0;
-        if (G < 0)
-            G = 0;
-        if (B < 0)
-            B = 0;
-        return Color(R, G, B);
+        return Color(std::max(0.0f, r - left.r), std::max(0.0f, g - left.g), std::max(0.0f, b - left.b));
     }
-    Color operator*(const float B) const { return Color((int)(B * r), (int)(B * g), (int)(B * b)); }
-    Color operator*(const Color &left) const { return Color((int)(r * left.r / GROSS), (int)(g * left.g / GROSS), (int)(b * left.b / GROSS)); }
-    Color operator/(const double t) const { return Color((int)(r / t), (int)(g / t), (int)(b / t)); }
+    Color operator*(const float B) const { return Color(B * r, B * g, B * b); }
+    //成分ごとの積(反射率を掛ける)
+    Color operator*(const Color &left) const { return Color(r * left.r, g * left.g, b * left.b); }
+    Color operator/(const double t) const { return Color(r / t, g / t, b / t); }
+    //最大成分
+    float Max() const { return std::max(r, std::max(g, b)); }
+    //輝度(Rec.709)
+    float Luminance() const { return 0.2126f * r + 0.7152f * g + 0.0722f * b; }
 };
+//画像の配列をfloatの並びとしても扱うため、余計な詰め物がないことを確認する
+static_assert(sizeof(Color) == 3 * sizeof(float), "Color must be three packed floats");
 
-Color Vector3::ToColor()
+template <class T>
+Color Vector3T<T>::ToColor() const
 {
-    Vector3 v(x, y, z);
+    Vector3T v(x, y, z);
     v.Norm();
-    Color color((int)((v.x + 1) * GROSS / 2), (int)((v.y + 1) * GROSS / 2), (int)((v.z + 1) * GROSS / 2));
+    Color color((v.x + 1) / 2, (v.y + 1) / 2, (v.z + 1) / 2);
     return color;
 }
 
-class Image
+//読み込み専用にメモリマップしたファイル
+class MappedFile
 {
 public:
-    Color **pixel;
-    int width, height;
-    Image() {} //クラス宣言用
-    Image(const int x, const int y)
+    const unsigned char *data;
+    size_t size;
+
+    MappedFile() : data(NULL), size(0) {}
+    ~MappedFile() { Close(); }
+    //同じ領域を二重に解放しないよう複製は禁止する
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    //ファイルをマップする(失敗したらfalse)
+    bool Open(const char *path)
     {
-        pixel = new Color *[x];
-        width = x;
-        height = y;
-        // 配列の各要素でintの配列を動的生成
-        for (int i = 0; i < x; i++)
+        Close();
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
         {
-            pixel[i] = new Color[y];
+            fprintf(stderr, "cannot open %s\n", path);
+            return false;
         }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            close(fd);
+            fprintf(stderr, "cannot read %s\n", path);
+            return false;
+        }
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+        {
+            fprintf(stderr, "cannot map %s\n", path);
+            return false;
+        }
+        data = (const unsigned char *)p;
+        size = (size_t)st.st_size;
+        //先頭から順に読むことをカーネルに伝える
+        madvise(p, size, MADV_SEQUENTIAL);
+        return true;
     }
-
-    void SetColor(int x, int y, Color color)
-    {
-        pixel[x][y] = color;
-    }
-    Color GetColor(int x, int y)
+    void Close()
     {
-        return pixel[x][y];
+        if (data != NULL)
+        {
+            munmap((void *)data, size);
+        }
+        data = NULL;
+        size = 0;
     }
 };
 
-//光線
-class Ray
+//テクスチャ(P6またはPFMをメモリマップし、画素はファイル上の配列をそのまま参照する)
+class Texture
 {
 public:
-    //変数
-    Vector3 origin;    //中心座標
-    Vector3 direction; //方向
-    int reflectCount;  //反射回数
-    bool inner;        //レイが物質内にいるか？
+    int width, height;
 
-    Ray(Vector3 o, Vector3 d)
+    Texture() : width(0), height(0), pixels(NULL), isFloat(false), flipY(false) {}
+    //メモリマップを共有しないよう複製は禁止する
+    Texture(const Texture &) = delete;
+    Texture &operator=(const Texture &) = delete;
+
+    //ファイルを読み込む(失敗したらfalse)
+    bool Load(const char *path)
     {
-        origin = o;
-        direction = d;
-        reflectCount = 0;
+        STATS_PHASE(PHASE_TEXTURE_LOAD);
+        Release();
+        if (!file.Open(path))
+        {
+            return false;
+        }
+        if (!ParseHeader())
+        {
+            fprintf(stderr, "unsupported image %s\n", path);
+            Release();
+            return false;
+        }
+        return true;
     }
-    void Set(Vector3 o, Vector3 d)
+    bool IsLoaded() const { return pixels != NULL; }
+    //画素(x,y)の色を取得(yは上から数える)
+    Color GetColor(int x, int y) const
     {
-        origin = o;
-        direction = d;
-        reflectCount = 0;
+        if (flipY)
+        {
+            y = height - 1 - y;
+        }
+        size_t index = ((size_t)y * width + x) * 3;
+        if (isFloat)
+        {
+            const float *p = (const float *)pixels + index;
+            return Color(p[0], p[1], p[2]);
+        }
+        const unsigned char *p = pixels + index;
+        return Color::FromByte(p[0], p[1], p[2]);
     }
-};
-
-enum reflectionType
-{
-    DIFFUSE,
-    REFLECTION,
-    REFRACTION,
-    BlinnPhong
-};
 
-class Material
-{
-public:
-    //色
-    Color color;
-    //反射率
-    float albedo;
-    //反射タイプ
-    reflectionType type;
-    //発光
-    //float emission;
-    //拡散反射
-    //float diffuse;
-    //鏡面反射
-    //float reflection;
-    //屈折
-    //float refraction;
+private:
+    MappedFile file;             //ファイル全体
+    const unsigned char *pixels; //画素の先頭(通常はfile内、変換が必要な場合はconverted)
+    bool isFloat;                //PFMか？
+    bool flipY;                  //下の行から格納されているか？(PFM)
+    std::vector<float> converted;
 
-    void Set(Color _color, float _albedo, reflectionType _type)
+    void Release()
     {
-        color = _color;
-        type = _type;
-        albedo = _albedo;
+        file.Close();
+        pixels = NULL;
+        width = height = 0;
+        converted.clear();
     }
-
-    Ray GetRay(Vector3 P, Vector3 I, Vector3 N, bool isInner)
+    //ヘッダの次の数値(#からのコメントは読み飛ばす)
+    bool ReadToken(size_t &pos, double &value) const
     {
-        //printf("matGetRay");
-        //拡散反射
-        if (type == DIFFUSE)
-        {
-            //printf("%f", drand48());
-            Vector3 R = N + Vector3().RandInUnitSphere();
-            return Ray(P, R);
-        }
-        //鏡面反射
-        if (type == REFLECTION)
-        {
-            Vector3 R = -I + N * (2 * N.Dot(I));
-            return Ray(P, R);
-        }
-        //屈折
-        if (type == REFRACTION)
+        while (pos < file.size)
         {
-            //相対屈折量
-            float n = 1.5;
-            if (isInner)
+            if (file.data[pos] == '#')
             {
-                //内部→外部
-                n = n;
+                while (pos < file.size && file.data[pos] != '\n')
+                    pos++;
+            }
+            else if (isspace(file.data[pos]))
+            {
+                pos++;
             }
             else
             {
-                n = 1 / n;
+                break;
             }
-            //内積をあらかじめ計算
-            float dot = I.Dot(N);
-            Vector3 T = I * n + N * (n * dot - sqrt(1 - n * n * (1 - dot * dot)));
-            return Ray(P, T);
         }
-        /*
-        //ブリンフォンs
-        if (type == BlinnPhong)
+        char buff[64];
+        size_t length = 0;
+        while (pos < file.size && length + 1 < sizeof(buff) && !isspace(file.data[pos]))
         {
+            buff[length++] = (char)file.data[pos++];
         }
-        */
-        return Ray(Vector3(0, 100, 0), Vector3(0, 1, 0)); //上空へレイを飛ばす
+        buff[length] = 0;
+        char *end;
+        value = strtod(buff, &end);
+        return length > 0 && *end == 0;
+    }
+    bool ParseHeader()
+    {
+        if (file.size < 2 || file.data[0] != 'P' || (file.data[1] != '6' && file.data[1] != 'F'))
+        {
+            return false;
+        }
+        isFloat = file.data[1] == 'F';
+        flipY = isFloat;
+        size_t pos = 2;
+        double w, h, maxValue;
+        if (!ReadToken(pos, w) || !ReadToken(pos, h) || !ReadToken(pos, maxValue))
+        {
+            return false;
+        }
+        //■ ヘッダの後は空白1文字を挟んで画素データ
+        pos++;
+        width = (int)w;
+        height = (int)h;
+        size_t size = (size_t)width * height * 3 * (isFloat ? sizeof(float) : 1);
+        if (width <= 0 || height <= 0 || pos + size > file.size || (!isFloat && maxValue != GROSS))
+        {
+            return false;
+        }
+        pixels = file.data + pos;
+        //PFMの倍率が正ならビッグエンディアンなので、この場合だけ変換して複製する
+        bool bigEndian = isFloat && maxValue > 0;
+        if (bigEndian || (isFloat && ((uintptr_t)pixels % sizeof(float)) != 0))
+        {
+            converted.resize(size / sizeof(float));
+            memcpy(&converted[0], pixels, size);
+            if (bigEndian)
+            {
+                for (size_t n = 0; n < converted.size(); n++)
+                {
+                    uint32_t v;
+                    memcpy(&v, &converted[n], sizeof(v));
+                    v = __builtin_bswap32(v);
+                    memcpy(&converted[n], &v, sizeof(v));
+                }
+            }
+            pixels = (const unsigned char *)&converted[0];
+        }
+        return true;
     }
 };
 
-//球体
-class Sphere
+//環境光(正距円筒図法の背景画像を、無限遠から届く光源として扱う)
+//画像の横方向が方位角atan2(z, x)の0~2π、縦方向が上(y = 1)から下(y = -1)までの天頂角0~π
+//  参照: メモリマップした画像の画素をそのまま双線形補間する(左右は反対側の端で折り返し、上下は端の画素を使う)
+//  サンプリング: 画素ごとの輝度×sin(天頂角)に比例した確率で、別名法(alias method)により定数時間で画素を選ぶ
+class EnvironmentLight
 {
 public:
-    //変数
-    Vector3 center;         //中心座標
-    float radius;           //半径
-    float solveT1, solveT2; //交点の解
-    Material material;      //マテリアル
+    int width, height;
 
-    //初期化
-    Sphere() {}
-    //セット
-    void Set(Vector3 _center, float _radius, Material _material)
-    {
-        center = _center;
-        radius = _radius;
-        material = _material;
-    }
+    EnvironmentLight() : width(0), height(0) {}
 
-    //交差判定
-    bool IsHit(Ray ray)
+    //画像を読み込み、画素を選ぶ別名表を作る(失敗したらfalse)
+    //画素はコピーせずにメモリマップしたまま参照する
+    bool Load(const char *path)
     {
-        Vector3 oc = ray.origin - center;
-        //二次方程式の定数a,b,cを求める
-        float a = (ray.direction).Dot(ray.direction);
-        float b = oc.Dot(ray.direction);
-        float c = oc.Dot(oc) - radius * radius;
-        //判別式Dを求める
-        float discriminant = b * b - a * c;
-        //交点が存在する場合
-        if (discriminant > 0)
+        if (!texture.Load(path))
+        {
+            return false;
+        }
+        width = texture.width;
+        height = texture.height;
+        //画素の重み(天頂角の方向に縮む立体角の分だけsinを掛ける)は、そのまま確率密度の配列に入れてから正規化する
+        size_t count = (size_t)width * height;
+        density.resize(count);
+        double total = 0;
+        for (int y = 0; y < height; y++)
         {
-            solveT1 = (-b - sqrt(discriminant)) / a; //解1(手前側)
-            solveT2 = (-b + sqrt(discriminant)) / a; //解2(奥側)
-            //交点が前方に存在する場合
-            if (solveT1 > 0.01)
+            float sinTheta = (float)sin(PI * (y + 0.5) / height);
+            for (int x = 0; x < width; x++)
             {
-                return true;
+                float weight = texture.GetColor(x, y).Luminance() * sinTheta;
+                density[(size_t)y * width + x] = weight;
+                total += weight;
             }
-            //交点が前方で奥側に存在する場合(つまり内→外の光線)
-
-            if (solveT2 > 0.01)
+        }
+        //真っ暗な画像は立体角に比例して選ぶ
+        if (!(total > 0))
+        {
+            total = 0;
+            for (int y = 0; y < height; y++)
             {
-                ray.inner = true;
-                return true;
+                float sinTheta = (float)sin(PI * (y + 0.5) / height);
+                for (int x = 0; x < width; x++)
+                {
+                    density[(size_t)y * width + x] = sinTheta;
+                    total += sinTheta;
+                }
             }
         }
-        return false;
+        //画像を[0,1]²とみなした確率密度と、別名表(Vose)
+        table.resize(count);
+        std::vector<int> small, large;
+        std::vector<float> scaled(count);
+        float normalize = (float)(count / total);
+        for (size_t n = 0; n < count; n++)
+        {
+            density[n] *= normalize;
+            scaled[n] = density[n];
+            (scaled[n] < 1 ? small : large).push_back((int)n);
+        }
+        while (!small.empty() && !large.empty())
+        {
+            int less = small.back(), more = large.back();
+            small.pop_back();
+            table[less].probability = scaled[less];
+            table[less].alias = more;
+            scaled[more] -= 1 - scaled[less];
+            if (scaled[more] < 1)
+            {
+                large.pop_back();
+                small.push_back(more);
+            }
+        }
+        //丸め誤差で残ったものは確率1で自分を選ぶ
+        for (size_t n = 0; n < small.size(); n++)
+        {
+            table[small[n]].probability = 1;
+            table[small[n]].alias = small[n];
+        }
+        for (size_t n = 0; n < large.size(); n++)
+        {
+            table[large[n]].probability = 1;
+            table[large[n]].alias = large[n];
+        }
+        return true;
     }
-    Color GetNormalRay(Ray ray)
+    //単位ベクトルの方向の色(双線形補間)
+    Color GetColor(const Vector3 &direction) const
     {
-        //反射位置Pを求める
-        Vector3 P = ray.origin + ray.direction * solveT1; //P = A + tB
-        //単位法線ベクトルを求める
-        Vector3 N = (P - center).Norm();
-        return N.ToColor();
+        float u, v;
+        ToImage(direction, u, v);
+        //画素の中心を基準にした座標(左上の画素x0は-1~width-1、y0は-1~height-1)
+        float x = u * width - 0.5f, y = v * height - 0.5f;
+        float floorX = floorf(x), floorY = floorf(y);
+        int x0 = (int)floorX, y0 = (int)floorY;
+        float fx = x - floorX, fy = y - floorY;
+        int left = (x0 + width) % width, right = (x0 + 1) % width;
+        int top = std::max(y0, 0), bottom = std::min(y0 + 1, height - 1);
+        Color upper = texture.GetColor(left, top) * (1 - fx) + texture.GetColor(right, top) * fx;
+        Color lower = texture.GetColor(left, bottom) * (1 - fx) + texture.GetColor(right, bottom) * fx;
+        return upper * (1 - fy) + lower * fy;
     }
-    Ray GetRay(Ray ray)
+    //一様乱数4つで方向を画素の重みに比例して選ぶ(方向の立体角あたりの確率密度がpdf、選べなければfalse)
+    bool Sample(float r0, float r1, float r2, float r3, Vector3 &direction, float &pdf) const
     {
-        //反射位置Pを求める
-        Vector3 P = ray.origin + ray.direction * solveT1; //P = A + tB
-        //入射ベクトルを求める
-        Vector3 I = -ray.direction.Norm();
-        //法線ベクトルを求める
-        Vector3 N = (P - center).Norm();
-        //反射位置に関して少し表面より外側に位置をずらす(エラー回避)
-        P = P + N * 0.0001;
-        //出て行く光か？
-        bool isInner = ray.inner;
-        //素材の違いを考慮したレイを取得する
-        return material.GetRay(P, I, N, isInner);
+        size_t count = table.size();
+        size_t index = std::min((size_t)(r0 * count), count - 1);
+        if (r1 >= table[index].probability)
+        {
+            index = table[index].alias;
+        }
+        //選んだ画素の中で一様に位置を決める
+        float u = ((index % width) + r2) / width;
+        float v = ((index / width) + r3) / height;
+        float theta = v * (float)PI, phi = u * (float)(2 * PI);
+        float sinTheta = sinf(theta);
+        if (sinTheta <= 0)
+        {
+            return false;
+        }
+        direction = Vector3(sinTheta * cosf(phi), cosf(theta), sinTheta * sinf(phi));
+        pdf = density[index] / (float)(2 * PI * PI * sinTheta);
+        return true;
+    }
+    //単位ベクトルの方向をSampleで選ぶ確率密度
+    float Pdf(const Vector3 &direction) const
+    {
+        float u, v;
+        ToImage(direction, u, v);
+        int x = std::min((int)(u * width), width - 1), y = std::min((int)(v * height), height - 1);
+        float sinTheta = (float)sqrt(std::max((Real)0, 1 - direction.y * direction.y));
+        if (sinTheta <= 0)
+        {
+            return 0;
+        }
+        return density[(size_t)y * width + x] / (float)(2 * PI * PI * sinTheta);
+    }
+
+private:
+    struct AliasEntry
+    {
+        float probability; //この画素を選ぶ確率(選ばなければaliasの画素)
+        int alias;
+    };
+    Texture texture;                //背景画像(メモリマップしたまま参照する)
+    std::vector<float> density;     //画素ごとの確率密度(画像を[0,1]²とみなす)
+    std::vector<AliasEntry> table;
+
+    //方向から画像上の座標(u, v)∈[0,1]²を求める(象限で場合分けしない)
+    static void ToImage(const Vector3 &direction, float &u, float &v)
+    {
+        u = atan2f((float)direction.z, (float)direction.x) * (float)(1 / (2 * PI));
+        u -= floorf(u);
+        v = acosf(std::min(1.0f, std::max(-1.0f, (float)direction.y))) * (float)(1 / PI);
     }
 };
 
-// 視界の管理クラス
-class Camera
+//画素の並べ方
+enum ImageLayout
 {
-private:
-    Vector3 X, Y, Z;      //カメラ基準の方向ベクトル
-    Vector3 screenOrigin; //スクリーンの原点
+    LAYOUT_ROW_MAJOR, //行優先
+    LAYOUT_MORTON,    //8x8画素のブロックを行優先に並べ、ブロック内はZ字(Morton)順
+};
 
+//画像(1つのアライメントを揃えた配列に全画素を格納する)
+class Image
+{
 public:
-    Vector3 eye;    //視点
-    Vector3 lookAt; //方向
-    double angle;   //アングル
+    typedef std::vector<Color, AlignedAllocator<Color, 64> > PixelArray;
+    int width, height;
+    ImageLayout layout;
+    PixelArray pixels;
 
-    //初期化
-    void Set(Vector3 _eye, Vector3 _lookAt, double _angle)
+    Image(int _width = 0, int _height = 0, ImageLayout _layout = LAYOUT_ROW_MAJOR) { Resize(_width, _height, _layout); }
+    //大きさと並べ方を設定して黒で埋める
+    void Resize(int _width, int _height, ImageLayout _layout = LAYOUT_ROW_MAJOR)
     {
-        eye = _eye;
-        lookAt = _lookAt;
-        angle = _angle;
-        SetScreenOrigin();
+        width = _width;
+        height = _height;
+        layout = _layout;
+        blocksX = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        size_t size = (size_t)width * height;
+        if (layout == LAYOUT_MORTON)
+        {
+            //端のブロックも埋まっているものとして確保する
+            size = (size_t)blocksX * ((height + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE * BLOCK_SIZE;
+        }
+        pixels.assign(size, Color(0, 0, 0));
     }
-
-    //uv座標の(i,j)の場所の光線を取得する
-    Ray GetScreenRay(int i, int j)
+    //テクスチャを指定の並べ方で複製する
+    void Assign(const Texture &texture, ImageLayout _layout)
     {
-        //-0.5~0.5の乱数を取得する
-        float randA = drand48() - 0.5;
-        float randB = drand48() - 0.5;
-        //光線の場所を求める
-        //Vector3 rayPos = screenOrigin + X * i + Y * j;
-        Vector3 rayPos = screenOrigin + X * (i + randA) + Y * (j + randB);
-        //光線をリターンする
-        return Ray(eye, (rayPos - eye).Norm());
+        Resize(texture.width, texture.height, _layout);
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                pixels[Index(x, y)] = texture.GetColor(x, y);
+            }
+        }
+    }
+    //画素(x,y)の配列上の位置
+    size_t Index(int x, int y) const
+    {
+        if (layout == LAYOUT_ROW_MAJOR)
+        {
+            return (size_t)y * width + x;
+        }
+        size_t block = (size_t)(y / BLOCK_SIZE) * blocksX + x / BLOCK_SIZE;
+        return block * BLOCK_SIZE * BLOCK_SIZE + Morton(x % BLOCK_SIZE, y % BLOCK_SIZE);
     }
+    Color &Pixel(int x, int y) { return pixels[Index(x, y)]; }
+    const Color &Pixel(int x, int y) const { return pixels[Index(x, y)]; }
+    void SetColor(int x, int y, Color color) { Pixel(x, y) = color; }
+    Color GetColor(int x, int y) const { return Pixel(x, y); }
 
 private:
-    void SetScreenOrigin()
+    enum
     {
-        //スクリーンまでの奥行きを求める
-        double depth = (HEIGHT / 2) / tan(angle * (PI / 180));
-        //スクリーン中心の座標を求める
-        Vector3 screenCenter = eye + lookAt.Norm() * depth;
-        //図のX,Y,Zベクトルを求める
-        Z = -lookAt.Norm();
-        X = -Vector3(0, 1, 0).Cross(Z).Norm(); //上向きベクトルとZの外積を求めて正規化
-        Y = Z.Cross(X).Norm();                 //ZとXの外積を求めて正規化
-        //スクリーン上での原点の座標を求める
-        screenOrigin = screenCenter - Y * (HEIGHT / 2) - X * (WIDTH / 2);
+        BLOCK_SIZE = 8
+    };
+    int blocksX; //横方向のブロック数
+    //ブロック内の位置(3bitずつのx,yを交互に並べる)
+    static int Morton(int x, int y)
+    {
+        return (x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2) | ((x & 4) << 2) | ((y & 4) << 3);
     }
 };
 
-class World
+//描画結果を蓄積するフレームバッファ(RGBの単精度浮動小数点の画像)
+//サンプルは線形に足し込むだけで、平均・トーンマップ・ガンマ変換は書き出し時にまとめて行う
+class FrameBuffer
 {
 public:
-    //カメラ
-    Camera camera;
-    //マテリアル
-    Material mat1, mat2, mat3, mirror;
-    //球体オブジェクト
-    Sphere ball_1, ball_2, ball_3, terrain;
-    Sphere objects[4];
-    //背景
-    Image backImage;
+    int width, height;
+    Image image; //サンプルの合計
 
-    //初期化
-    World()
+    FrameBuffer(int _width = 0, int _height = 0, ImageLayout layout = LAYOUT_ROW_MAJOR) { Resize(_width, _height, layout); }
+    void Resize(int _width, int _height, ImageLayout layout = LAYOUT_ROW_MAJOR)
     {
-        //カメラを設定
-        camera.Set(Vector3(0, 0, 0), Vector3(0, 0, -1), 45); //座標、視線方向、仰角
-        //マテリアルを設定
-        mat1.Set(Color(0, 200, 255), 0.5, DIFFUSE);
-        mat2.Set(Color(255, 100, 200), 0.5, DIFFUSE);
-        mat3.Set(Color(100, 255, 100), 0.5, DIFFUSE);
-        mirror.Set(Color(255, 255, 150), 0.5, REFLECTION);
-        //オブジェクトを設定
-        ball_1.Set(Vector3(2, 0, -3), 1, mat1);
-        ball_2.Set(Vector3(0, 0, -3), 1, mat2);
-        ball_3.Set(Vector3(-2, 0, -3), 1, mat3);
-        terrain.Set(Vector3(2, -501, 2), 500, mirror);
-        //オブジェクトを登録
-        objects[0] = ball_1;
-        objects[1] = ball_2;
-        objects[2] = ball_3;
-        objects[3] = terrain;
-        //背景を登録
-        backImage = ReadPPM();
-    }
-    //画像生成
-    void GetImage()
-    {
-        //printf("tesuto");
-        /*============================*/
-        /*   カラー画像の書き込み     */
-        /*============================*/
-        FILE *fp;
-        fp = fopen("./output1.ppm", "wb");     //■ write binaryモードで画像ファイルを開く
-        fprintf(fp, "P3\n");                   //■ ファイルの識別符号を書き込む
-        fprintf(fp, "%d %d\n", WIDTH, HEIGHT); //■ 画像サイズを書き込む
-        fprintf(fp, "%d\n", GROSS);            //■ 最大輝度値を書き込む
-
-        //■ 画像データの書き込み
-        for (int y = 0; y < HEIGHT; y++)
-        {
-            for (int x = 0; x < WIDTH; x++)
-            {
-                //カラーを格納する変数を作成
-                int red = 0, green = 0, blue = 0;
-                //レイを飛ばす
-                for (int n = 0; n < SAMPLING_SIZE; n++)
-                {
-                    //printf("完了度：(%d, %d, %d)\n", y, x, n);
-                    //カメラからの光線を取得する
-                    Ray cameraRay = camera.GetScreenRay(x, y);
-                    //光線を飛ばして色を取得し加算
-                    //Color sum = CastRay(cameraRay);
-                    //Color sum = GetNormal(cameraRay);
-                    //Color sum = GetDepth(cameraRay);
-                    //Color sum = GetColor(cameraRay);
-                    //Color sum = GetSecond(cameraRay);
-                    Color sum = GetOutline(cameraRay);
-                    red += sum.r;
-                    green += sum.g;
-                    blue += sum.b;
-                }
-                //すること
-                //被写界深度深度を求める
-                //ピンボケを作る
-                //法線ベクトルを作る
-                //サンプリングの平均を取得
-                red = (int)(red / SAMPLING_SIZE);
-                green = (int)(green / SAMPLING_SIZE);
-                blue = (int)(blue / SAMPLING_SIZE);
-                //ガンマ変換
-                double gamma = (double)(1 / 2.2);
-                red = (int)(GROSS * pow(((double)red / GROSS), gamma));
-                green = (int)(GROSS * pow(((double)green / GROSS), gamma));
-                blue = (int)(GROSS * pow(((double)blue / GROSS), gamma));
-                //取得した色を書き込む
-                fprintf(fp, "%d %d %d ", red, green, blue);
+        width = _width;
+        height = _height;
+        image.Resize(width, height, layout);
+    }
+    //ピクセルに輝度を加算
+    void Add(int x, int y, const Color &color)
+    {
+        Color &p = image.Pixel(x, y);
+        p = p + color;
+    }
+    Color Get(int x, int y) const { return image.Pixel(x, y); }
+    //全画素の値(並べ方によっては余白を含む)
+    float *Data() { return &image.pixels[0].r; }
+    const float *Data() const { return &image.pixels[0].r; }
+    size_t DataSize() const { return image.pixels.size() * 3; }
+    //行yのRGBを左から並べたもの(行優先でなければscratchに並べ直す)
+    const float *Row(int y, std::vector<float> &scratch) const
+    {
+        if (image.layout == LAYOUT_ROW_MAJOR)
+        {
+            return &image.pixels[(size_t)y * width].r;
+        }
+        scratch.resize((size_t)width * 3);
+        for (int x = 0; x < width; x++)
+        {
+            const Color &c = image.Pixel(x, y);
+            scratch[x * 3] = c.r;
+            scratch[x * 3 + 1] = c.g;
+            scratch[x * 3 + 2] = c.b;
+        }
+        return &scratch[0];
+    }
+};
+
+//ピクセルごとのサンプル数と輝度の平均・分散(Welfordの逐次計算)
+//適応的サンプリングで、どのピクセルにさらにサンプルが必要かを判定するのに使う
+class PixelStats
+{
+public:
+    int width, height;
+
+    PixelStats(int _width = 0, int _height = 0) { Resize(_width, _height); }
+    void Resize(int _width, int _height)
+    {
+        width = _width;
+        height = _height;
+        entries.assign((size_t)width * height, Entry());
+    }
+    //サンプルの輝度を追加
+    void Add(int x, int y, float luminance)
+    {
+        Entry &e = entries[(size_t)y * width + x];
+        e.count++;
+        float delta = luminance - e.mean;
+        e.mean += delta / e.count;
+        e.m2 += delta * (luminance - e.mean);
+    }
+    int Count(int x, int y) const { return entries[(size_t)y * width + x].count; }
+    //平均の相対標準誤差(サンプルが2つ未満なら無限大)
+    float RelativeError(int x, int y) const
+    {
+        const Entry &e = entries[(size_t)y * width + x];
+        if (e.count < 2)
+        {
+            return HUGE_VALF;
+        }
+        float variance = e.m2 / (e.count - 1);
+        //真っ暗なピクセルで相対誤差が発散しないよう分母に下駄を履かせる
+        return sqrtf(variance / e.count) / (e.mean + 1e-3f);
+    }
+
+private:
+    struct Entry
+    {
+        int count;
+        float mean, m2;
+        Entry() : count(0), mean(0), m2(0) {}
+    };
+    std::vector<Entry> entries;
+};
+
+//エッジを保つÀ-trousウェーブレットのノイズ除去(Dammertz et al. 2010)
+//5×5のB3スプラインの間隔を1, 2, 4, ...と広げながら繰り返し掛け、色・法線・距離の逆数・物体の色が違う画素の重みを下げる
+//画素は成分ごとの配列(SoA)に並べ、タップごとに行全体を連続して処理するので、内側のループは分岐なしでベクトル化される
+class Denoiser
+{
+public:
+    int iterations;     //フィルタを掛ける回数(最後の間隔は2^(iterations-1)画素)
+    float colorSigma;   //色の差の許容幅(回数ごとに半分にする)
+    float normalSigma;  //法線AOVの差の許容幅
+    float depthSigma;   //距離の相対的な差の許容幅
+    float albedoSigma;  //物体の色の差の許容幅
+    float fireflySigma; //周囲の平均から標準偏差の何倍を超えた画素をファイアフライとして抑えるか
+
+    Denoiser() : iterations(5), colorSigma(0.6f), normalSigma(0.1f), depthSigma(0.05f), albedoSigma(0.1f), fireflySigma(3) {}
+
+    //beautyのノイズをnormal・disparity(距離の逆数)・albedoを手掛かりに除く
+    //各フレームはサンプルの合計で、scaleを掛けると平均になる(結果も合計のままbeautyに書き戻す)
+    void Run(FrameBuffer &beauty, const FrameBuffer &normal, const FrameBuffer &disparity, const FrameBuffer &albedo, float scale, int threadCount)
+    {
+        width = beauty.width;
+        height = beauty.height;
+        size_t size = (size_t)width * height;
+        for (int c = 0; c < PLANE_COUNT; c++)
+        {
+            planes[c].resize(size);
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            output[c].resize(size);
+        }
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                size_t n = (size_t)y * width + x;
+                const Color *colors[4] = {&beauty.image.Pixel(x, y), &normal.image.Pixel(x, y), &disparity.image.Pixel(x, y), &albedo.image.Pixel(x, y)};
+                planes[COLOR_R][n] = colors[0]->r * scale;
+                planes[COLOR_G][n] = colors[0]->g * scale;
+                planes[COLOR_B][n] = colors[0]->b * scale;
+                planes[NORMAL_X][n] = colors[1]->r * scale;
+                planes[NORMAL_Y][n] = colors[1]->g * scale;
+                planes[NORMAL_Z][n] = colors[1]->b * scale;
+                planes[DISPARITY][n] = colors[2]->r * scale;
+                planes[ALBEDO_R][n] = colors[3]->r * scale;
+                planes[ALBEDO_G][n] = colors[3]->g * scale;
+                planes[ALBEDO_B][n] = colors[3]->b * scale;
+            }
+        }
+        ClampFireflies();
+        for (int iteration = 0; iteration < iterations; iteration++)
+        {
+            //行を帯に分けて全スレッドで処理し、結果を入力の色と入れ替えて次の回に進む
+            float sigma = colorSigma / (float)(1 << iteration);
+            std::vector<std::thread> workers;
+            int band = (height + threadCount - 1) / threadCount;
+            for (int t = 0; t < threadCount; t++)
+            {
+                int y0 = t * band, y1 = std::min(height, y0 + band);
+                workers.push_back(std::thread([this, iteration, sigma, y0, y1]() {
+                    FilterRows(1 << iteration, sigma, y0, y1);
+                }));
+            }
+            for (size_t t = 0; t < workers.size(); t++)
+            {
+                workers[t].join();
+            }
+            for (int c = 0; c < 3; c++)
+            {
+                planes[COLOR_R + c].swap(output[c]);
+            }
+        }
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                size_t n = (size_t)y * width + x;
+                beauty.image.Pixel(x, y) = Color(planes[COLOR_R][n], planes[COLOR_G][n], planes[COLOR_B][n]) * (1 / scale);
+            }
+        }
+    }
+
+private:
+    typedef std::vector<float, AlignedAllocator<float> > Plane;
+    enum
+    {
+        COLOR_R,
+        COLOR_G,
+        COLOR_B,
+        NORMAL_X,
+        NORMAL_Y,
+        NORMAL_Z,
+        DISPARITY,
+        ALBEDO_R,
+        ALBEDO_G,
+        ALBEDO_B,
+        PLANE_COUNT
+    };
+    int width, height;
+    Plane planes[PLANE_COUNT];
+    Plane output[3];
+
+    //周囲8画素の明るさの平均+fireflySigma×標準偏差を超える画素を、その明るさまで暗くする
+    //孤立した明るい画素(ファイアフライ)は色の差が大きく周囲から平均されないため、先に抑えておく
+    //(周囲も明るい光源や、ばらつきの範囲に収まるハイライトはそのまま残す)
+    void ClampFireflies()
+    {
+        std::vector<float> luminance((size_t)width * height);
+        for (size_t n = 0; n < luminance.size(); n++)
+        {
+            luminance[n] = Color(planes[COLOR_R][n], planes[COLOR_G][n], planes[COLOR_B][n]).Luminance();
+        }
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                float sum = 0, sumSquared = 0;
+                int count = 0;
+                for (int qy = std::max(0, y - 1); qy <= std::min(height - 1, y + 1); qy++)
+                {
+                    for (int qx = std::max(0, x - 1); qx <= std::min(width - 1, x + 1); qx++)
+                    {
+                        if (qx != x || qy != y)
+                        {
+                            float l = luminance[(size_t)qy * width + qx];
+                            sum += l;
+                            sumSquared += l * l;
+                            count++;
+                        }
+                    }
+                }
+                float mean = sum / count;
+                float limit = mean + fireflySigma * sqrtf(std::max(0.0f, sumSquared / count - mean * mean));
+                size_t n = (size_t)y * width + x;
+                if (luminance[n] > limit)
+                {
+                    float ratio = limit / luminance[n];
+                    planes[COLOR_R][n] *= ratio;
+                    planes[COLOR_G][n] *= ratio;
+                    planes[COLOR_B][n] *= ratio;
+                }
+            }
+        }
+    }
+    //行[y0, y1)に間隔stepのフィルタを1回掛けてoutputに書き込む
+    void FilterRows(int step, float sigma, int y0, int y1)
+    {
+        static const float KERNEL[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+        float colorScale = 1 / (sigma * sigma), normalScale = 1 / (normalSigma * normalSigma);
+        float depthScale = 1 / (depthSigma * depthSigma), albedoScale = 1 / (albedoSigma * albedoSigma);
+        std::vector<float> sum[4];
+        for (int c = 0; c < 4; c++)
+        {
+            sum[c].resize(width);
+        }
+        for (int y = y0; y < y1; y++)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                std::fill(sum[c].begin(), sum[c].end(), 0.0f);
+            }
+            size_t row = (size_t)y * width;
+            for (int i = 0; i < 5; i++)
+            {
+                int qy = y + (i - 2) * step;
+                if (qy < 0 || qy >= height)
+                {
+                    continue;
+                }
+                for (int j = 0; j < 5; j++)
+                {
+                    //画面外に出るタップは使わない(範囲を先に絞るので、ループの中には分岐がない)
+                    int dx = (j - 2) * step;
+                    int x0 = std::max(0, -dx), x1 = std::min(width, width - dx);
+                    ptrdiff_t offset = (ptrdiff_t)qy * width + dx;
+                    float h = KERNEL[i] * KERNEL[j];
+                    //中心の画素pとタップの画素qの各成分
+                    const float *pr = &planes[COLOR_R][row], *pg = &planes[COLOR_G][row], *pb = &planes[COLOR_B][row];
+                    const float *pnx = &planes[NORMAL_X][row], *pny = &planes[NORMAL_Y][row], *pnz = &planes[NORMAL_Z][row];
+                    const float *pz = &planes[DISPARITY][row];
+                    const float *par = &planes[ALBEDO_R][row], *pag = &planes[ALBEDO_G][row], *pab = &planes[ALBEDO_B][row];
+                    const float *qr = &planes[COLOR_R][0] + offset, *qg = &planes[COLOR_G][0] + offset, *qb = &planes[COLOR_B][0] + offset;
+                    const float *qnx = &planes[NORMAL_X][0] + offset, *qny = &planes[NORMAL_Y][0] + offset, *qnz = &planes[NORMAL_Z][0] + offset;
+                    const float *qz = &planes[DISPARITY][0] + offset;
+                    const float *qar = &planes[ALBEDO_R][0] + offset, *qag = &planes[ALBEDO_G][0] + offset, *qab = &planes[ALBEDO_B][0] + offset;
+                    float *sumR = &sum[0][0], *sumG = &sum[1][0], *sumB = &sum[2][0], *sumW = &sum[3][0];
+                    //sumは入力の配列と重ならないので、依存関係の検査を省いてベクトル化させる
+#pragma GCC ivdep
+                    for (int x = x0; x < x1; x++)
+                    {
+                        float cr = qr[x] - pr[x], cg = qg[x] - pg[x], cb = qb[x] - pb[x];
+                        float nx = qnx[x] - pnx[x], ny = qny[x] - pny[x], nz = qnz[x] - pnz[x];
+                        //距離の逆数の差を大きい方で割り、遠くても近くても同じ割合の距離の差を同じに扱う(両方外れなら差は0)
+                        float dz = (qz[x] - pz[x]) / std::max(std::max(qz[x], pz[x]), 1e-20f);
+                        float ar = qar[x] - par[x], ag = qag[x] - pag[x], ab = qab[x] - pab[x];
+                        float distance = (cr * cr + cg * cg + cb * cb) * colorScale + (nx * nx + ny * ny + nz * nz) * normalScale + dz * dz * depthScale + (ar * ar + ag * ag + ab * ab) * albedoScale;
+                        float w = h * ExpNegative(distance);
+                        sumR[x] += w * qr[x];
+                        sumG[x] += w * qg[x];
+                        sumB[x] += w * qb[x];
+                        sumW[x] += w;
+                    }
+                }
+            }
+            //中心の画素は差が0なので重みが必ず正になり、0では割らない
+            for (int x = 0; x < width; x++)
+            {
+                float inverse = 1 / sum[3][x];
+                output[0][row + x] = sum[0][x] * inverse;
+                output[1][row + x] = sum[1][x] * inverse;
+                output[2][row + x] = sum[2][x] * inverse;
+            }
+        }
+    }
+    //exp(-x)の近似(1 - x/8)^8(x >= 8では0。関数呼び出しがないのでベクトル化できる)
+    static float ExpNegative(float x)
+    {
+        float t = std::max(0.0f, 1 - x * (1.0f / 8));
+        t *= t;
+        t *= t;
+        return t * t;
+    }
+};
+
+//トーンマップとガンマ変換(表示用の8bitに変換する後処理)
+//powを毎回呼ばないよう、sqrtを取った値で引く変換表を使う(暗部でも量子化誤差は0.5階調未満)
+class ToneMapper
+{
+public:
+    float exposure; //露出(輝度に掛ける倍率)
+    float gamma;    //ガンマ値
+
+    ToneMapper(float _exposure = 1.0f, float _gamma = 2.2f)
+    {
+        exposure = _exposure;
+        gamma = _gamma;
+        for (int n = 0; n < TABLE_SIZE; n++)
+        {
+            double s = (double)n / (TABLE_SIZE - 1);
+            table[n] = (unsigned char)(GROSS * pow(s * s, 1 / gamma) + 0.5);
+        }
+    }
+    //連続したsize個の値を変換する(scaleはサンプル数の逆数など)
+    void Apply(const float *in, float scale, unsigned char *out, size_t size) const
+    {
+        float s = scale * exposure;
+        size_t n = 0;
+#if defined(__AVX__)
+        //8個ずつ変換表の番号を求める
+        __m256 vs = _mm256_set1_ps(s), one = _mm256_set1_ps(1.0f), last = _mm256_set1_ps(TABLE_SIZE - 1);
+        for (; n + 8 <= size; n += 8)
+        {
+            __m256 v = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(in + n), vs), _mm256_setzero_ps()), one);
+            int index[8];
+            _mm256_storeu_si256((__m256i *)index, _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_sqrt_ps(v), last)));
+            for (int m = 0; m < 8; m++)
+            {
+                out[n + m] = table[index[m]];
             }
         }
-        fclose(fp);
+#endif
+        for (; n < size; n++)
+        {
+            //範囲外は切り詰める
+            float v = std::min(std::max(in[n] * s, 0.0f), 1.0f);
+            out[n] = table[(int)(sqrtf(v) * (TABLE_SIZE - 1) + 0.5f)];
+        }
+    }
+
+private:
+    enum
+    {
+        TABLE_SIZE = 4096
+    };
+    unsigned char table[TABLE_SIZE];
+};
+
+//画像ファイルの形式
+enum ImageFormat
+{
+    FORMAT_P3,  //PPM(テキスト)
+    FORMAT_P6,  //PPM(バイナリ)
+    FORMAT_PFM, //PFM(単精度浮動小数点、HDR)
+};
+
+//拡張子から画像形式を判定する
+ImageFormat ImageFormatFromPath(const std::string &path)
+{
+    if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".pfm") == 0)
+    {
+        return FORMAT_PFM;
+    }
+    return FORMAT_P6;
+}
+
+//フレームバッファを画像ファイルに書き出す
+//行は上から順に何回かに分けて渡せるので、描画中に書き出すこともできる
+class ImageWriter
+{
+public:
+    ImageWriter() : fp(NULL) {}
+    ~ImageWriter() { Close(); }
+
+    //ファイルを開いてヘッダを書き込む
+    bool Open(const char *path, ImageFormat _format, int _width, int _height)
+    {
+        Close();
+        format = _format;
+        width = _width;
+        height = _height;
+        fp = fopen(path, "wb"); //■ write binaryモードで画像ファイルを開く
+        if (fp == NULL)
+        {
+            fprintf(stderr, "cannot open %s\n", path);
+            return false;
+        }
+        //書き込みをまとめて行うためにバッファを大きく取る
+        buffer.resize(1 << 20);
+        setvbuf(fp, &buffer[0], _IOFBF, buffer.size());
+        if (format == FORMAT_PFM)
+        {
+            //■ 負の倍率はリトルエンディアンを表す
+            fprintf(fp, "PF\n%d %d\n-1.0\n", width, height);
+        }
+        else
+        {
+            fprintf(fp, "%s\n%d %d\n%d\n", format == FORMAT_P3 ? "P3" : "P6", width, height, GROSS);
+        }
+        headerSize = ftell(fp);
+        return true;
+    }
+    //行[y0, y1)を書き出す(scaleはサンプル数の逆数など)
+    void WriteRows(const FrameBuffer &frame, int y0, int y1, float scale, const ToneMapper &toneMapper)
+    {
+        STATS_PHASE(PHASE_WRITE);
+        if (fp == NULL)
+        {
+            return;
+        }
+        size_t rowSize = (size_t)width * 3;
+        if (format == FORMAT_PFM)
+        {
+            //PFMは下の行から格納するので、行[y0, y1)はファイル内でy1-1からy0の順に連続して並ぶ
+            //1回だけ移動してから逆順に書き込む(移動するとバッファが書き出されるので、行ごとには移動しない)
+            if (y1 <= y0)
+            {
+                return;
+            }
+            fseek(fp, headerSize + (long)((height - y1) * rowSize * sizeof(float)), SEEK_SET);
+            floats.resize(rowSize);
+            for (int y = y1 - 1; y >= y0; y--)
+            {
+                const float *in = frame.Row(y, scratch);
+                for (size_t n = 0; n < rowSize; n++)
+                {
+                    floats[n] = in[n] * scale;
+                }
+                fwrite(&floats[0], sizeof(float), rowSize, fp);
+            }
+            return;
+        }
+        //8bitに変換する
+        bytes.resize(rowSize * (y1 - y0));
+        for (int y = y0; y < y1; y++)
+        {
+            toneMapper.Apply(frame.Row(y, scratch), scale, &bytes[(y - y0) * rowSize], rowSize);
+        }
+        if (format == FORMAT_P6)
+        {
+            fwrite(&bytes[0], 1, bytes.size(), fp);
+        }
+        else
+        {
+            //■ 画像データの書き込み
+            for (size_t n = 0; n < bytes.size(); n += 3)
+            {
+                fprintf(fp, "%d %d %d ", bytes[n], bytes[n + 1], bytes[n + 2]);
+            }
+        }
+    }
+    //ファイルを閉じる(書き込みに失敗していたらfalse)
+    bool Close()
+    {
+        if (fp == NULL)
+        {
+            return true;
+        }
+        STATS_PHASE(PHASE_WRITE);
+        bool ok = !ferror(fp);
+        ok = fclose(fp) == 0 && ok;
+        fp = NULL;
+        return ok;
+    }
+
+private:
+    FILE *fp;
+    ImageFormat format;
+    int width, height;
+    long headerSize;
+    std::vector<char> buffer;
+    std::vector<unsigned char> bytes;
+    std::vector<float> floats; //PFMに書き出す行
+    std::vector<float> scratch;
+};
+
+//光線(成分の型Tはfloatかdouble)
+template <class T>
+class RayT
+{
+public:
+    //変数
+    Vector3T<T> origin;    //中心座標
+    Vector3T<T> direction; //方向
+    int reflectCount;      //反射回数
+
+    RayT() { reflectCount = 0; }
+    RayT(Vector3T<T> o, Vector3T<T> d)
+    {
+        origin = o;
+        direction = d;
+        reflectCount = 0;
+    }
+    void Set(Vector3T<T> o, Vector3T<T> d)
+    {
+        origin = o;
+        direction = d;
+        reflectCount = 0;
+    }
+};
+typedef RayT<Real> Ray;
+
+//交差情報
+template <class T>
+struct HitRecordT
+{
+    T t;                //交点までの距離(P = A + tB)
+    Vector3T<T> point;  //交点
+    Vector3T<T> normal; //単位法線ベクトル(光線と向かい合う向き)
+    bool frontFace;     //外側から当たったか？(falseなら内→外の光線)
+    int materialId;     //マテリアル番号
+    int objectId;       //物体番号(球体は0以上、メッシュのインスタンスnは~n)
+};
+typedef HitRecordT<Real> HitRecord;
+
+enum reflectionType
+{
+    DIFFUSE,
+    REFLECTION,
+    REFRACTION,
+    BlinnPhong
+};
+
+class Material
+{
+public:
+    //色
+    Color color;
+    //反射率
+    float albedo;
+    //反射タイプ
+    reflectionType type;
+    //発光(放射輝度、黒なら光らない)
+    Color emission;
+    //拡散反射
+    //float diffuse;
+    //鏡面反射
+    //float reflection;
+    //屈折
+    //float refraction;
+
+    void Set(Color _color, float _albedo, reflectionType _type, Color _emission = Color(0, 0, 0))
+    {
+        color = _color;
+        type = _type;
+        albedo = _albedo;
+        emission = _emission;
+    }
+    //光るか？
+    bool IsEmissive() const { return emission.Max() > 0; }
+
+    Ray GetRay(Vector3 P, Vector3 I, Vector3 N, bool isInner, Sampler &sampler) const
+    {
+        //printf("matGetRay");
+        //拡散反射
+        if (type == DIFFUSE)
+        {
+            //printf("%f", drand48());
+            //余弦分布(確率密度cos/π)で選ぶので、MISで光源サンプリングと重みを比べられる
+            Vector3 R = N + Vector3::RandOnUnitSphere(sampler);
+            return Ray(P, R);
+        }
+        //鏡面反射
+        if (type == REFLECTION)
+        {
+            Vector3 R = -I + N * (2 * N.Dot(I));
+            return Ray(P, R);
+        }
+        //屈折
+        if (type == REFRACTION)
+        {
+            //相対屈折量
+            Real n = 1.5;
+            if (isInner)
+            {
+                //内部→外部
+                n = n;
+            }
+            else
+            {
+                n = 1 / n;
+            }
+            //内積をあらかじめ計算
+            Real dot = I.Dot(N);
+            Real k = 1 - n * n * (1 - dot * dot);
+            //全反射
+            if (k < 0)
+            {
+                return Ray(P, -I + N * (2 * dot));
+            }
+            Vector3 T = -I * n + N * (n * dot - sqrt(k));
+            return Ray(P, T);
+        }
+        /*
+        //ブリンフォンs
+        if (type == BlinnPhong)
+        {
+        }
+        */
+        return Ray(Vector3(0, 100, 0), Vector3(0, 1, 0)); //上空へレイを飛ばす
+    }
+};
+
+//球体(成分の型Tはfloatかdouble)
+template <class T>
+class SphereT
+{
+public:
+    //変数
+    Vector3T<T> center; //中心座標
+    T radius;           //半径
+    int materialId;     //マテリアル番号
+
+    //初期化
+    SphereT() {}
+    //セット
+    void Set(Vector3T<T> _center, T _radius, int _materialId)
+    {
+        center = _center;
+        radius = _radius;
+        materialId = _materialId;
+    }
+
+    //交差判定(tMaxより手前で交差する場合のみhitを書き換える)
+    bool IsHit(const RayT<T> &ray, T tMax, HitRecordT<T> &hit) const
+    {
+        Vector3T<T> oc = ray.origin - center;
+        //二次方程式の定数a,b,cを求める
+        T a = ray.direction.Dot(ray.direction);
+        T b = oc.Dot(ray.direction);
+        T c = oc.Dot(oc) - radius * radius;
+        //判別式Dを求める
+        T discriminant = b * b - a * c;
+        //交点が存在しない場合
+        if (discriminant <= 0)
+        {
+            return false;
+        }
+        T root = sqrt(discriminant);
+        //解1(手前側)が前方に存在する場合は外側から、解2(奥側)のみ前方なら内→外の光線
+        T t = (-b - root) / a;
+        if (t <= 0.01)
+        {
+            t = (-b + root) / a;
+        }
+        if (t <= 0.01 || t >= tMax)
+        {
+            return false;
+        }
+        hit.t = t;
+        hit.point = ray.origin + ray.direction * t; //P = A + tB
+        Vector3T<T> N = (hit.point - center) * (1.0 / radius);
+        hit.frontFace = ray.direction.Dot(N) < 0;
+        hit.normal = hit.frontFace ? N : -N;
+        hit.materialId = materialId;
+        return true;
+    }
+};
+typedef SphereT<Real> Sphere;
+
+//三角形メッシュ(頂点座標の配列と、面ごとに頂点番号を3つずつ並べた配列)
+//バイナリ形式のファイルはメモリマップした配列をそのまま使うので、数百万面でも読み込みで変換もコピーもしない
+//  "RTMESH01"(8バイト) 頂点数(uint32) 面数(uint32) 頂点座標(float x y z × 頂点数) 頂点番号(uint32 × 3 × 面数)
+//  (数値はリトルエンディアン)
+class Mesh
+{
+public:
+    const float *vertices;   //頂点座標(x, y, zの順)
+    const uint32_t *indices; //面ごとの頂点番号
+    int vertexCount, faceCount;
+
+    Mesh() : vertices(NULL), indices(NULL), vertexCount(0), faceCount(0) {}
+    //メモリマップを共有しないよう複製は禁止する
+    Mesh(const Mesh &) = delete;
+    Mesh &operator=(const Mesh &) = delete;
+
+    //バイナリ形式のファイルを読み込む(失敗したらfalse)
+    bool Load(const char *path)
+    {
+        Release();
+        if (!file.Open(path))
+        {
+            return false;
+        }
+        uint32_t counts[2];
+        if (file.size < 16 || memcmp(file.data, MAGIC, 8) != 0)
+        {
+            fprintf(stderr, "%s: not a mesh file\n", path);
+            file.Close();
+            return false;
+        }
+        memcpy(counts, file.data + 8, sizeof(counts));
+        if (counts[0] > INT32_MAX / 3 || counts[1] > INT32_MAX / 3 || file.size != 16 + (uint64_t)counts[0] * 12 + (uint64_t)counts[1] * 12)
+        {
+            fprintf(stderr, "%s: invalid mesh size\n", path);
+            file.Close();
+            return false;
+        }
+        vertexCount = (int)counts[0];
+        faceCount = (int)counts[1];
+        vertices = (const float *)(file.data + 16);
+        indices = (const uint32_t *)(file.data + 16 + (size_t)vertexCount * 12);
+        //範囲外の頂点番号があると描画中に不正な読み込みになるので、ここで一度だけ調べる
+        for (size_t n = 0; n < (size_t)faceCount * 3; n++)
+        {
+            if (indices[n] >= (uint32_t)vertexCount)
+            {
+                fprintf(stderr, "%s: face %zu refers to missing vertex %u\n", path, n / 3, indices[n]);
+                Release();
+                return false;
+            }
+        }
+        //BVHの構築と描画では面を順不同に参照する
+        madvise((void *)file.data, file.size, MADV_RANDOM);
+        return true;
+    }
+    //メモリ上の配列から作る(OBJの変換やベンチマーク用)
+    void Assign(std::vector<float> &&_vertices, std::vector<uint32_t> &&_indices)
+    {
+        Release();
+        ownedVertices = std::move(_vertices);
+        ownedIndices = std::move(_indices);
+        vertices = ownedVertices.data();
+        indices = ownedIndices.data();
+        vertexCount = (int)(ownedVertices.size() / 3);
+        faceCount = (int)(ownedIndices.size() / 3);
+    }
+    //バイナリ形式で書き出す(失敗したらfalse)
+    bool Save(const char *path) const
+    {
+        FILE *fp = fopen(path, "wb");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "cannot open %s\n", path);
+            return false;
+        }
+        uint32_t counts[2] = {(uint32_t)vertexCount, (uint32_t)faceCount};
+        fwrite(MAGIC, 1, 8, fp);
+        fwrite(counts, sizeof(uint32_t), 2, fp);
+        fwrite(vertices, sizeof(float), (size_t)vertexCount * 3, fp);
+        fwrite(indices, sizeof(uint32_t), (size_t)faceCount * 3, fp);
+        bool ok = !ferror(fp);
+        if (fclose(fp) != 0 || !ok)
+        {
+            fprintf(stderr, "cannot write %s\n", path);
+            return false;
+        }
+        return true;
+    }
+    //n番目の頂点
+    Vector3 Vertex(uint32_t n) const
+    {
+        const float *p = vertices + 3 * (size_t)n;
+        return Vector3(p[0], p[1], p[2]);
+    }
+    //face番目の面の頂点
+    void Face(int face, Vector3 &a, Vector3 &b, Vector3 &c) const
+    {
+        const uint32_t *index = indices + 3 * (size_t)face;
+        a = Vertex(index[0]);
+        b = Vertex(index[1]);
+        c = Vertex(index[2]);
+    }
+
+private:
+    static constexpr const char *MAGIC = "RTMESH01";
+    MappedFile file;
+    std::vector<float> ownedVertices;
+    std::vector<uint32_t> ownedIndices;
+
+    void Release()
+    {
+        file.Close();
+        ownedVertices.clear();
+        ownedIndices.clear();
+        vertices = NULL;
+        indices = NULL;
+        vertexCount = faceCount = 0;
+    }
+};
+
+//水密な三角形判定用に前計算した光線(Woop, Benthin, Wald 2013)
+//方向の最大成分の軸がzになるよう軸を入れ替え、光線が+z軸に重なるよう剪断してから辺関数を2次元で求める
+//隣り合う三角形は共有する辺で同じ値になるので、辺や頂点の上を通る光線もすり抜けない
+template <class T>
+struct TriangleRayT
+{
+    int kx, ky, kz;
+    T sx, sy, sz;
+    Vector3T<T> origin;
+
+    TriangleRayT() {}
+    TriangleRayT(const RayT<T> &ray) { Set(ray); }
+    void Set(const RayT<T> &ray)
+    {
+        T d[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+        kz = fabs(d[0]) > fabs(d[1]) ? (fabs(d[0]) > fabs(d[2]) ? 0 : 2) : (fabs(d[1]) > fabs(d[2]) ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        //zが負の向きなら面の向き(辺関数の符号)を保つようxとyを入れ替える
+        if (d[kz] < 0)
+        {
+            std::swap(kx, ky);
+        }
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1 / d[kz];
+        origin = ray.origin;
+    }
+    //三角形(a, b, c)とtMin < t < tMaxで交差すればtを求める
+    bool Intersect(const Vector3T<T> &a, const Vector3T<T> &b, const Vector3T<T> &c, T tMin, T tMax, T &t) const
+    {
+        T A[3], B[3], C[3];
+        Relative(a, A);
+        Relative(b, B);
+        Relative(c, C);
+        //剪断した頂点の2次元座標
+        T ax = A[kx] - sx * A[kz], ay = A[ky] - sy * A[kz];
+        T bx = B[kx] - sx * B[kz], by = B[ky] - sy * B[kz];
+        T cx = C[kx] - sx * C[kz], cy = C[ky] - sy * C[kz];
+        //辺関数
+        T u = cx * by - cy * bx;
+        T v = ax * cy - ay * cx;
+        T w = bx * ay - by * ax;
+        //辺の上ちょうどの場合は倍精度で求め直し、隣の三角形と判定を揃える
+        if (u == 0 || v == 0 || w == 0)
+        {
+            u = (T)((double)cx * by - (double)cy * bx);
+            v = (T)((double)ax * cy - (double)ay * cx);
+            w = (T)((double)bx * ay - (double)by * ax);
+        }
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+        {
+            return false;
+        }
+        T det = u + v + w;
+        if (det == 0)
+        {
+            return false;
+        }
+        //重心座標で補間した距離(det倍したまま範囲を調べ、当たる場合だけ割り算する)
+        T scaled = (u * A[kz] + v * B[kz] + w * C[kz]) * sz;
+        T sign = det < 0 ? -1 : 1;
+        if (scaled * sign <= tMin * det * sign || scaled * sign >= tMax * det * sign)
+        {
+            return false;
+        }
+        t = scaled / det;
+        return true;
+    }
+
+private:
+    void Relative(const Vector3T<T> &p, T *q) const
+    {
+        q[0] = p.x - origin.x;
+        q[1] = p.y - origin.y;
+        q[2] = p.z - origin.z;
+    }
+};
+typedef TriangleRayT<Real> TriangleRay;
+
+//軸平行境界ボックス
+struct AABB
+{
+    Vector3 min, max;
+
+    //空のボックスで初期化
+    AABB() : min(HUGE_VAL, HUGE_VAL, HUGE_VAL), max(-HUGE_VAL, -HUGE_VAL, -HUGE_VAL) {}
+    AABB(const Vector3 &_min, const Vector3 &_max) : min(_min), max(_max) {}
+    //点を含むように拡張
+    void Grow(const Vector3 &p)
+    {
+        min.Set(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max.Set(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+    //ボックスを含むように拡張
+    void Grow(const AABB &b)
+    {
+        Grow(b.min);
+        Grow(b.max);
+    }
+    Vector3 Center() const { return (min + max) * 0.5; }
+    //表面積(SAHのコスト計算用)
+    double Area() const
+    {
+        Vector3 e = max - min;
+        if (e.x < 0)
+            return 0;
+        return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+};
+
+//球体の境界ボックス
+inline AABB SphereBounds(const Sphere &sphere)
+{
+    Vector3 r(sphere.radius, sphere.radius, sphere.radius);
+    return AABB(sphere.center - r, sphere.center + r);
+}
+
+//アフィン変換(3×3の行列と平行移動、p' = M p + t)
+//メッシュのインスタンスを物体座標から世界座標へ置くのと、光線をその逆に戻すのに使う
+struct Transform
+{
+    Real m[3][4]; //各行は行列の成分3つと平行移動
+
+    //恒等変換
+    Transform()
+    {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                m[i][j] = i == j;
+    }
+    //倍率、回転(軸と角度[度])、平行移動の順に行う変換
+    static Transform Make(const Vector3 &position, Vector3 axis, double degrees, double scale)
+    {
+        Transform result;
+        if (axis.Length() > 0)
+        {
+            axis.Norm();
+        }
+        double c = cos(degrees * PI / 180), s = sin(degrees * PI / 180), C = 1 - c;
+        double x = axis.x, y = axis.y, z = axis.z;
+        //ロドリゲスの回転公式
+        double R[3][3] = {{c + x * x * C, x * y * C - z * s, x * z * C + y * s},
+                          {y * x * C + z * s, c + y * y * C, y * z * C - x * s},
+                          {z * x * C - y * s, z * y * C + x * s, c + z * z * C}};
+        double t[3] = {position.x, position.y, position.z};
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                result.m[i][j] = (Real)(R[i][j] * scale);
+            }
+            result.m[i][3] = (Real)t[i];
+        }
+        return result;
+    }
+    //逆変換を求める(行列が正則でなければfalse)
+    bool Inverse(Transform &inverse) const
+    {
+        //余因子から倍精度で求める
+        double a[3][3];
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                a[i][j] = m[i][j];
+        double cofactor[3][3];
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                int i1 = (i + 1) % 3, i2 = (i + 2) % 3, j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+                cofactor[i][j] = a[i1][j1] * a[i2][j2] - a[i1][j2] * a[i2][j1];
+            }
+        }
+        double det = a[0][0] * cofactor[0][0] + a[0][1] * cofactor[0][1] + a[0][2] * cofactor[0][2];
+        if (!(fabs(det) > 1e-300))
+        {
+            return false;
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            double t = 0;
+            for (int j = 0; j < 3; j++)
+            {
+                //逆行列は余因子行列の転置を行列式で割ったもの
+                double value = cofactor[j][i] / det;
+                inverse.m[i][j] = (Real)value;
+                t -= value * m[j][3];
+            }
+            inverse.m[i][3] = (Real)t;
+        }
+        return true;
+    }
+    //点を変換
+    Vector3 Point(const Vector3 &p) const
+    {
+        return Vector3(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                       m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                       m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+    //方向を変換(平行移動しない。正規化もしないので、光線の距離tは変換の前後で変わらない)
+    Vector3 Direction(const Vector3 &v) const
+    {
+        return Vector3(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                       m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                       m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+    //転置した行列で方向を変換(逆変換に使うと、物体座標の法線を世界座標の法線に直せる)
+    Vector3 TransposedDirection(const Vector3 &v) const
+    {
+        return Vector3(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+                       m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+                       m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+    }
+    //境界ボックスの8頂点を変換して、それを含むボックスを求める
+    AABB Bounds(const AABB &box) const
+    {
+        AABB result;
+        for (int corner = 0; corner < 8; corner++)
+        {
+            result.Grow(Point(Vector3(corner & 1 ? box.max.x : box.min.x, corner & 2 ? box.max.y : box.min.y, corner & 4 ? box.max.z : box.min.z)));
+        }
+        return result;
+    }
+};
+
+//BVHのノード(32バイト、配列に平坦化して格納)
+//count > 0なら葉で、プリミティブ[leftFirst, leftFirst + count)を持つ
+//count == 0なら節で、子はnodes[leftFirst]とnodes[leftFirst + 1]
+struct BVHNode
+{
+    float boundsMin[3];
+    int leftFirst;
+    float boundsMax[3];
+    int count;
+};
+
+//BVH走査用に前計算した光線
+struct BVHRay
+{
+    float origin[3];
+    float invDirection[3];
+
+    BVHRay(const Ray &ray)
+    {
+        origin[0] = (float)ray.origin.x;
+        origin[1] = (float)ray.origin.y;
+        origin[2] = (float)ray.origin.z;
+        invDirection[0] = (float)(1 / ray.direction.x);
+        invDirection[1] = (float)(1 / ray.direction.y);
+        invDirection[2] = (float)(1 / ray.direction.z);
+    }
+    //ボックスとの交差距離を求める(交差しなければHUGE_VALF)
+    float Slab(const BVHNode &node, float tMax) const
+    {
+        float tNear = 0, tFar = tMax;
+        for (int a = 0; a < 3; a++)
+        {
+            float t0 = (node.boundsMin[a] - origin[a]) * invDirection[a];
+            float t1 = (node.boundsMax[a] - origin[a]) * invDirection[a];
+            tNear = std::max(tNear, std::min(t0, t1));
+            tFar = std::min(tFar, std::max(t0, t1));
+        }
+        return tNear <= tFar ? tNear : HUGE_VALF;
+    }
+};
+
+//境界ボリューム階層(SAHで構築し、ノードを配列に平坦化する)
+class BVH
+{
+public:
+    std::vector<BVHNode> nodes; //nodes[0]が根
+    std::vector<int> indices;   //葉の並び順に並べたプリミティブ番号
+
+    //プリミティブの境界ボックスから構築する
+    //leafWidthは葉で一度に判定するプリミティブ数(球体はSIMD幅、1つずつ判定する三角形などは1)
+    void Build(const std::vector<AABB> &bounds, int _leafWidth = SPHERE_SIMD_WIDTH)
+    {
+        leafWidth = _leafWidth;
+        int count = (int)bounds.size();
+        nodes.clear();
+        indices.resize(count);
+        for (int n = 0; n < count; n++)
+        {
+            indices[n] = n;
+        }
+        if (count == 0)
+        {
+            return;
+        }
+        //ノード数は最大で2N-1個(途中で再確保されないよう先に確保する)
+        nodes.reserve(2 * count - 1);
+        BVHNode root;
+        root.leftFirst = 0;
+        root.count = count;
+        nodes.push_back(root);
+        std::vector<BuildItem> items(count);
+        for (int n = 0; n < count; n++)
+        {
+            //floatへの丸めで縮まないよう外側に広げる
+            for (int a = 0; a < 3; a++)
+            {
+                items[n].bounds.min[a] = nextafterf((float)Axis(bounds[n].min, a), -HUGE_VALF);
+                items[n].bounds.max[a] = nextafterf((float)Axis(bounds[n].max, a), HUGE_VALF);
+                items[n].center[a] = (float)Axis(bounds[n].Center(), a);
+            }
+            items[n].index = n;
+        }
+        Subdivide(0, 0, items);
+        for (int n = 0; n < count; n++)
+        {
+            indices[n] = items[n].index;
+        }
+    }
+
+    //光線と最も近いプリミティブを求める
+    //leafは葉のプリミティブ範囲(first, count)とtMaxを受け取り、tMaxを縮めた場合にtrueを返す
+    //visitedNodesがあれば辿ったノード数を加算する
+    template <class LeafIntersector>
+    bool Intersect(const Ray &ray, Real &tMax, LeafIntersector &leaf, long *visitedNodes = NULL) const
+    {
+        if (nodes.empty())
+        {
+            return false;
+        }
+        BVHRay bvhRay(ray);
+        if (bvhRay.Slab(nodes[0], (float)tMax) == HUGE_VALF)
+        {
+            return false;
+        }
+        bool isHit = false;
+        int stack[BVH_STACK_SIZE];
+        int stackSize = 0;
+        int nodeIndex = 0;
+        int visited = 0;
+        while (true)
+        {
+            const BVHNode &node = nodes[nodeIndex];
+            visited++;
+            if (node.count > 0)
+            {
+                //葉ならプリミティブと交差判定
+                if (leaf(node.leftFirst, node.count, tMax))
+                {
+                    isHit = true;
+                }
+            }
+            else
+            {
+                //近い方の子から辿り、遠い方はスタックに積む
+                int near = node.leftFirst, far = node.leftFirst + 1;
+                float tNear = bvhRay.Slab(nodes[near], (float)tMax);
+                float tFar = bvhRay.Slab(nodes[far], (float)tMax);
+                if (tFar < tNear)
+                {
+                    std::swap(near, far);
+                    std::swap(tNear, tFar);
+                }
+                if (tNear != HUGE_VALF)
+                {
+                    if (tFar != HUGE_VALF)
+                    {
+                        stack[stackSize++] = far;
+                    }
+                    nodeIndex = near;
+                    continue;
+                }
+            }
+            //スタックから次のノードを取り出す
+            if (stackSize == 0)
+            {
+                break;
+            }
+            nodeIndex = stack[--stackSize];
+        }
+        if (visitedNodes != NULL)
+        {
+            *visitedNodes += visited;
+        }
+        return isHit;
+    }
+
+private:
+    int leafWidth = SPHERE_SIMD_WIDTH;
+
+    //構築用の単精度の境界ボックス
+    struct BuildBox
+    {
+        float min[3], max[3];
+
+        BuildBox()
+        {
+            min[0] = min[1] = min[2] = HUGE_VALF;
+            max[0] = max[1] = max[2] = -HUGE_VALF;
+        }
+        void Grow(const float *p)
+        {
+            for (int a = 0; a < 3; a++)
+            {
+                min[a] = std::min(min[a], p[a]);
+                max[a] = std::max(max[a], p[a]);
+            }
+        }
+        void Grow(const BuildBox &b)
+        {
+            for (int a = 0; a < 3; a++)
+            {
+                min[a] = std::min(min[a], b.min[a]);
+                max[a] = std::max(max[a], b.max[a]);
+            }
+        }
+        double Area() const
+        {
+            double x = max[0] - min[0], y = max[1] - min[1], z = max[2] - min[2];
+            if (x < 0)
+                return 0;
+            return 2 * (x * y + y * z + z * x);
+        }
+    };
+    //構築中のプリミティブ(並べ替えで参照先が飛び散らないよう、境界ボックスと中心を番号と一緒に並べ替える)
+    struct BuildItem
+    {
+        BuildBox bounds;
+        float center[3];
+        int index;
+    };
+
+    //ノードのプリミティブをSAHで二分割する
+    //走査スタックには祖先ごとに1つまでしか積まれないので、深さをBVH_STACK_SIZE未満に抑えれば溢れない
+    void Subdivide(int nodeIndex, int depth, std::vector<BuildItem> &items)
+    {
+        int first = nodes[nodeIndex].leftFirst;
+        int count = nodes[nodeIndex].count;
+        //ノードと中心点の境界ボックスを求める
+        BuildBox nodeBounds, centerBounds;
+        for (int n = first; n < first + count; n++)
+        {
+            nodeBounds.Grow(items[n].bounds);
+            centerBounds.Grow(items[n].center);
+        }
+        SetBounds(nodes[nodeIndex], nodeBounds);
+        if (count <= 1 || depth + 1 >= BVH_STACK_SIZE)
+        {
+            return;
+        }
+        //全軸のビンを1回の走査でまとめて集計する
+        float lo[3], scale[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            lo[axis] = centerBounds.min[axis];
+            float extent = centerBounds.max[axis] - lo[axis];
+            scale[axis] = extent > 0 ? BVH_BIN_SIZE / extent : 0;
+        }
+        BuildBox binBounds[3][BVH_BIN_SIZE];
+        int binCount[3][BVH_BIN_SIZE] = {{0}};
+        for (int n = first; n < first + count; n++)
+        {
+            const BuildItem &item = items[n];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                int bin = std::min(BVH_BIN_SIZE - 1, (int)((item.center[axis] - lo[axis]) * scale[axis]));
+                binBounds[axis][bin].Grow(item.bounds);
+                binCount[axis][bin]++;
+            }
+        }
+        //各軸の分割面のうち最小コストのものを探す
+        double bestCost = HUGE_VAL;
+        int bestAxis = -1, bestSplit = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (scale[axis] == 0)
+            {
+                continue;
+            }
+            //左右から累積して各分割面のコストを求める
+            double leftArea[BVH_BIN_SIZE - 1], rightArea[BVH_BIN_SIZE - 1];
+            int leftCount[BVH_BIN_SIZE - 1], rightCount[BVH_BIN_SIZE - 1];
+            BuildBox leftBox, rightBox;
+            int leftSum = 0, rightSum = 0;
+            for (int n = 0; n < BVH_BIN_SIZE - 1; n++)
+            {
+                leftBox.Grow(binBounds[axis][n]);
+                leftSum += binCount[axis][n];
+                leftArea[n] = leftBox.Area();
+                leftCount[n] = leftSum;
+                rightBox.Grow(binBounds[axis][BVH_BIN_SIZE - 1 - n]);
+                rightSum += binCount[axis][BVH_BIN_SIZE - 1 - n];
+                rightArea[BVH_BIN_SIZE - 2 - n] = rightBox.Area();
+                rightCount[BVH_BIN_SIZE - 2 - n] = rightSum;
+            }
+            for (int n = 0; n < BVH_BIN_SIZE - 1; n++)
+            {
+                double cost = leftArea[n] * Packets(leftCount[n]) + rightArea[n] * Packets(rightCount[n]);
+                if (leftCount[n] > 0 && rightCount[n] > 0 && cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = n + 1;
+                }
+            }
+        }
+        //分割しても得にならない小さなノードは葉にする
+        double leafCost = nodeBounds.Area() * Packets(count);
+        double splitCost = nodeBounds.Area() * BVH_TRAVERSAL_COST + bestCost;
+        if (bestAxis < 0 || (splitCost >= leafCost && count <= BVH_MAX_LEAF_SIZE))
+        {
+            return;
+        }
+        //分割面で並べ替える
+        float splitLo = lo[bestAxis], splitScale = scale[bestAxis];
+        BuildItem *middle = std::partition(&items[first], &items[first] + count, [&](const BuildItem &item) {
+            return std::min(BVH_BIN_SIZE - 1, (int)((item.center[bestAxis] - splitLo) * splitScale)) < bestSplit;
+        });
+        int leftCount = (int)(middle - &items[first]);
+        //子ノードを作成して再帰的に分割
+        int leftIndex = (int)nodes.size();
+        BVHNode left, right;
+        left.leftFirst = first;
+        left.count = leftCount;
+        right.leftFirst = first + leftCount;
+        right.count = count - leftCount;
+        nodes.push_back(left);
+        nodes.push_back(right);
+        nodes[nodeIndex].leftFirst = leftIndex;
+        nodes[nodeIndex].count = 0;
+        Subdivide(leftIndex, depth + 1, items);
+        Subdivide(leftIndex + 1, depth + 1, items);
+    }
+    static double Axis(const Vector3 &v, int axis) { return axis == 0 ? v.x : axis == 1 ? v.y : v.z; }
+    //葉の判定コスト(一括判定する回数)
+    int Packets(int count) const { return (count + leafWidth - 1) / leafWidth; }
+    //ノードに境界ボックスを設定
+    static void SetBounds(BVHNode &node, const BuildBox &box)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            node.boundsMin[a] = box.min[a];
+            node.boundsMax[a] = box.max[a];
+        }
+    }
+};
+
+//球体の一括判定用に単精度へ変換した光線
+struct SoARay
+{
+    float origin[3], direction[3];
+    float a; //方向ベクトルの長さの2乗
+
+    SoARay(const Ray &ray)
+    {
+        origin[0] = (float)ray.origin.x;
+        origin[1] = (float)ray.origin.y;
+        origin[2] = (float)ray.origin.z;
+        direction[0] = (float)ray.direction.x;
+        direction[1] = (float)ray.direction.y;
+        direction[2] = (float)ray.direction.z;
+        a = (float)ray.direction.Dot(ray.direction);
+    }
+};
+
+//球体を成分ごとの配列(SoA)で保持し、複数個を同時に交差判定する
+class SphereSoA
+{
+public:
+    typedef std::vector<float, AlignedAllocator<float> > FloatArray;
+    FloatArray centerX, centerY, centerZ, radius2; //中心座標と半径の2乗
+
+    //球体の配列から作成する(末尾はSIMD幅分だけ当たらない球体で埋める)
+    void Build(const std::vector<Sphere> &spheres)
+    {
+        size_t size = spheres.size() + SPHERE_SIMD_WIDTH;
+        centerX.assign(size, 0);
+        centerY.assign(size, 0);
+        centerZ.assign(size, 0);
+        radius2.assign(size, -1);
+        for (size_t n = 0; n < spheres.size(); n++)
+        {
+            centerX[n] = (float)spheres[n].center.x;
+            centerY[n] = (float)spheres[n].center.y;
+            centerZ[n] = (float)spheres[n].center.z;
+            radius2[n] = spheres[n].radius * spheres[n].radius;
+        }
+    }
+
+    //球体[first, first + count)のうちtMaxより手前で最も近い球体の番号を返す(なければ-1)
+    int Nearest(const SoARay &ray, int first, int count, float tMax) const
+    {
+#if SPHERE_SIMD_WIDTH == 8
+        __m256 ox = _mm256_set1_ps(ray.origin[0]), oy = _mm256_set1_ps(ray.origin[1]), oz = _mm256_set1_ps(ray.origin[2]);
+        __m256 dx = _mm256_set1_ps(ray.direction[0]), dy = _mm256_set1_ps(ray.direction[1]), dz = _mm256_set1_ps(ray.direction[2]);
+        __m256 a = _mm256_set1_ps(ray.a), invA = _mm256_set1_ps(1 / ray.a), eps = _mm256_set1_ps(0.01f);
+        __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7), size = _mm256_set1_ps((float)count);
+        __m256 bestT = _mm256_set1_ps(tMax), bestLane = _mm256_set1_ps(-1);
+        for (int n = 0; n < count; n += 8, lane = _mm256_add_ps(lane, _mm256_set1_ps(8)))
+        {
+            __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&centerX[first + n]));
+            __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&centerY[first + n]));
+            __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&centerZ[first + n]));
+            //二次方程式の定数b,cと判別式
+            __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+            __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_loadu_ps(&radius2[first + n]));
+            __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(a, c));
+            __m256 root = _mm256_sqrt_ps(_mm256_max_ps(discriminant, _mm256_setzero_ps()));
+            //手前側の解が前方になければ奥側の解を使う
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_setzero_ps(), _mm256_add_ps(b, root)), invA);
+            __m256 t2 = _mm256_mul_ps(_mm256_sub_ps(root, b), invA);
+            __m256 t = _mm256_blendv_ps(t2, t1, _mm256_cmp_ps(t1, eps, _CMP_GT_OQ));
+            __m256 valid = _mm256_and_ps(_mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GT_OQ), _mm256_cmp_ps(t, eps, _CMP_GT_OQ));
+            valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, bestT, _CMP_LT_OQ), _mm256_cmp_ps(lane, size, _CMP_LT_OQ)));
+            bestT = _mm256_blendv_ps(bestT, t, valid);
+            bestLane = _mm256_blendv_ps(bestLane, lane, valid);
+        }
+        //全レーンの最小値を求める
+        __m256 m = _mm256_min_ps(bestT, _mm256_permute2f128_ps(bestT, bestT, 1));
+        m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+        m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+        int mask = _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(bestT, m, _CMP_EQ_OQ), _mm256_cmp_ps(bestLane, _mm256_setzero_ps(), _CMP_GE_OQ)));
+        if (mask == 0)
+        {
+            return -1;
+        }
+        float lanes[8];
+        _mm256_storeu_ps(lanes, bestLane);
+        return first + (int)lanes[__builtin_ctz(mask)];
+#elif SPHERE_SIMD_WIDTH == 4
+        __m128 ox = _mm_set1_ps(ray.origin[0]), oy = _mm_set1_ps(ray.origin[1]), oz = _mm_set1_ps(ray.origin[2]);
+        __m128 dx = _mm_set1_ps(ray.direction[0]), dy = _mm_set1_ps(ray.direction[1]), dz = _mm_set1_ps(ray.direction[2]);
+        __m128 a = _mm_set1_ps(ray.a), invA = _mm_set1_ps(1 / ray.a), eps = _mm_set1_ps(0.01f);
+        __m128 lane = _mm_setr_ps(0, 1, 2, 3), size = _mm_set1_ps((float)count);
+        __m128 bestT = _mm_set1_ps(tMax), bestLane = _mm_set1_ps(-1);
+        for (int n = 0; n < count; n += 4, lane = _mm_add_ps(lane, _mm_set1_ps(4)))
+        {
+            __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(&centerX[first + n]));
+            __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(&centerY[first + n]));
+            __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(&centerZ[first + n]));
+            //二次方程式の定数b,cと判別式
+            __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+            __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_loadu_ps(&radius2[first + n]));
+            __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+            __m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+            //手前側の解が前方になければ奥側の解を使う(SSE2にはblendがないのでand/andnotで選択)
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_setzero_ps(), _mm_add_ps(b, root)), invA);
+            __m128 t2 = _mm_mul_ps(_mm_sub_ps(root, b), invA);
+            __m128 front = _mm_cmpgt_ps(t1, eps);
+            __m128 t = _mm_or_ps(_mm_and_ps(front, t1), _mm_andnot_ps(front, t2));
+            __m128 valid = _mm_and_ps(_mm_cmpgt_ps(discriminant, _mm_setzero_ps()), _mm_cmpgt_ps(t, eps));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(t, bestT), _mm_cmplt_ps(lane, size)));
+            bestT = _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, bestT));
+            bestLane = _mm_or_ps(_mm_and_ps(valid, lane), _mm_andnot_ps(valid, bestLane));
+        }
+        //全レーンの最小値を求める
+        __m128 m = _mm_min_ps(bestT, _mm_shuffle_ps(bestT, bestT, _MM_SHUFFLE(1, 0, 3, 2)));
+        m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+        int mask = _mm_movemask_ps(_mm_and_ps(_mm_cmpeq_ps(bestT, m), _mm_cmpge_ps(bestLane, _mm_setzero_ps())));
+        if (mask == 0)
+        {
+            return -1;
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes, bestLane);
+        return first + (int)lanes[__builtin_ctz(mask)];
+#else
+        int nearest = -1;
+        for (int n = first; n < first + count; n++)
+        {
+            float ocx = ray.origin[0] - centerX[n], ocy = ray.origin[1] - centerY[n], ocz = ray.origin[2] - centerZ[n];
+            float b = ocx * ray.direction[0] + ocy * ray.direction[1] + ocz * ray.direction[2];
+            float c = ocx * ocx + ocy * ocy + ocz * ocz - radius2[n];
+            float discriminant = b * b - ray.a * c;
+            if (discriminant <= 0)
+                continue;
+            float root = sqrtf(discriminant);
+            float t = (-b - root) / ray.a;
+            if (t <= 0.01f)
+                t = (-b + root) / ray.a;
+            if (t > 0.01f && t < tMax)
+            {
+                tMax = t;
+                nearest = n;
+            }
+        }
+        return nearest;
+#endif
+    }
+};
+
+//メッシュごとの下位BVH(BLAS)
+//同じメッシュを置いたインスタンスはすべてこれを1つ共有し、光線を物体座標に戻して判定する
+class MeshBVH
+{
+public:
+    std::shared_ptr<const Mesh> mesh;
+    BVH bvh; //プリミティブ番号は面の番号
+
+    //メッシュの全ての面からBVHを構築する
+    void Build(const std::shared_ptr<const Mesh> &_mesh)
+    {
+        mesh = _mesh;
+        std::vector<AABB> bounds(mesh->faceCount);
+        for (int face = 0; face < mesh->faceCount; face++)
+        {
+            Vector3 a, b, c;
+            mesh->Face(face, a, b, c);
+            bounds[face] = AABB(a, a);
+            bounds[face].Grow(b);
+            bounds[face].Grow(c);
+        }
+        //三角形は1つずつ判定するので、葉の大きさは面の数でコストを見積もる
+        bvh.Build(bounds, 1);
+    }
+    //物体座標の境界ボックス
+    AABB Bounds() const
+    {
+        if (bvh.nodes.empty())
+        {
+            return AABB();
+        }
+        const BVHNode &root = bvh.nodes[0];
+        return AABB(Vector3(root.boundsMin[0], root.boundsMin[1], root.boundsMin[2]), Vector3(root.boundsMax[0], root.boundsMax[1], root.boundsMax[2]));
+    }
+    //物体座標の光線とtMin < t < tMaxで最も近い面の番号を求め、tMaxをその距離に縮める(なければ-1)
+    int Intersect(const Ray &ray, Real tMin, Real &tMax) const
+    {
+        TriangleRay triangleRay(ray);
+        int face = -1;
+        FaceLeaf leaf = {this, &triangleRay, tMin, &face};
+        bvh.Intersect(ray, tMax, leaf);
+        return face;
+    }
+
+private:
+    //葉の三角形を順に調べる
+    struct FaceLeaf
+    {
+        const MeshBVH *blas;
+        const TriangleRay *triangleRay;
+        Real tMin;
+        int *face;
+
+        bool operator()(int first, int count, Real &tMax) const
+        {
+            STATS_ADD(triangleTests, count);
+            bool isHit = false;
+            for (int n = first; n < first + count; n++)
+            {
+                Vector3 a, b, c;
+                blas->mesh->Face(blas->bvh.indices[n], a, b, c);
+                Real t;
+                if (triangleRay->Intersect(a, b, c, tMin, tMax, t))
+                {
+                    tMax = t;
+                    *face = blas->bvh.indices[n];
+                    isHit = true;
+                }
+            }
+            return isHit;
+        }
+    };
+};
+
+//シーン(マテリアルと任意個の球体・メッシュのインスタンスを保持する)
+//球体とインスタンスは1つの上位BVH(TLAS)に入れ、インスタンスの葉では共有する下位BVHを辿る
+//メッシュのメモリは置いた数ではなく、異なるメッシュの数に比例する
+class Scene
+{
+public:
+    //メッシュのインスタンス(共有する下位BVHの番号と、物体座標から世界座標への変換)
+    struct Instance
+    {
+        int mesh;
+        int materialId;
+        Transform toWorld, toObject;
+    };
+    std::vector<Material> materials;
+    std::vector<Sphere> objects;                         //Build()後はBVHの葉の順に並ぶ
+    std::vector<int> lights;                             //発光するマテリアルの球体の番号(Build()後のobjectsの並び)
+    SphereSoA soa;                                       //objectsと同じ順に並べたSIMD判定用の配列
+    std::vector<std::shared_ptr<const MeshBVH> > meshes; //インスタンスが参照する異なるメッシュ(同じものは1つだけ)
+    std::vector<Instance> instances;                     //Build()後はBVHの葉の順に並ぶ
+    std::vector<int> spheresBefore;                      //葉の並びで位置nより前にある球体の数(インスタンスがなければ空)
+    BVH bvh;
+
+    //マテリアルを追加して番号を返す
+    int AddMaterial(Color color, float albedo, reflectionType type, Color emission = Color(0, 0, 0))
+    {
+        Material material;
+        material.Set(color, albedo, type, emission);
+        materials.push_back(material);
+        return (int)materials.size() - 1;
+    }
+    //球体を追加して番号を返す
+    int AddSphere(Vector3 center, float radius, int materialId)
+    {
+        Sphere sphere;
+        sphere.Set(center, radius, materialId);
+        objects.push_back(sphere);
+        return (int)objects.size() - 1;
+    }
+    //メッシュのインスタンスを置いて番号を返す(toWorldが正則でなければ-1)
+    //同じMeshBVHを何度置いても、下位BVHと頂点は共有して1つだけ持つ
+    int AddMesh(const std::shared_ptr<const MeshBVH> &mesh, int materialId, const Transform &toWorld = Transform())
+    {
+        Instance instance;
+        instance.materialId = materialId;
+        instance.toWorld = toWorld;
+        if (!toWorld.Inverse(instance.toObject))
+        {
+            return -1;
+        }
+        std::unordered_map<const MeshBVH *, int>::const_iterator found = meshIds.find(mesh.get());
+        if (found == meshIds.end())
+        {
+            found = meshIds.insert(std::make_pair(mesh.get(), (int)meshes.size())).first;
+            meshes.push_back(mesh);
+        }
+        instance.mesh = found->second;
+        instances.push_back(instance);
+        return (int)instances.size() - 1;
+    }
+    //異なるメッシュの三角形の総数
+    size_t TriangleCount() const
+    {
+        size_t count = 0;
+        for (size_t n = 0; n < meshes.size(); n++)
+        {
+            count += meshes[n]->mesh->faceCount;
+        }
+        return count;
+    }
+    //上位BVHを構築し、球体とインスタンスをそれぞれ葉の順に並べ替える
+    //プリミティブ番号は球体が[0, 球体数)、インスタンスがその後に続く
+    void Build()
+    {
+        int sphereCount = (int)objects.size();
+        std::vector<AABB> bounds(objects.size() + instances.size());
+        for (int n = 0; n < sphereCount; n++)
+        {
+            bounds[n] = SphereBounds(objects[n]);
+        }
+        for (size_t n = 0; n < instances.size(); n++)
+        {
+            bounds[sphereCount + n] = instances[n].toWorld.Bounds(meshes[instances[n].mesh]->Bounds());
+        }
+        //インスタンスの判定は下位BVHを辿るので、まとめて判定する球体と違い1つずつコストを見積もる
+        bvh.Build(bounds, instances.empty() ? SPHERE_SIMD_WIDTH : 1);
+        spheresBefore.clear();
+        if (!instances.empty())
+        {
+            //葉の中では球体を先に並べ、葉ごとに球体とインスタンスの連続した範囲で判定できるようにする
+            for (size_t n = 0; n < bvh.nodes.size(); n++)
+            {
+                const BVHNode &node = bvh.nodes[n];
+                if (node.count > 0)
+                {
+                    int *first = &bvh.indices[node.leftFirst];
+                    std::stable_partition(first, first + node.count, [sphereCount](int index) { return index < sphereCount; });
+                }
+            }
+            spheresBefore.resize(bounds.size() + 1);
+            spheresBefore[0] = 0;
+            for (size_t n = 0; n < bounds.size(); n++)
+            {
+                spheresBefore[n + 1] = spheresBefore[n] + (bvh.indices[n] < sphereCount);
+            }
+        }
+        std::vector<Sphere> sorted;
+        std::vector<Instance> sortedInstances;
+        sorted.reserve(objects.size());
+        sortedInstances.reserve(instances.size());
+        for (size_t n = 0; n < bounds.size(); n++)
+        {
+            int index = bvh.indices[n];
+            if (index < sphereCount)
+            {
+                sorted.push_back(objects[index]);
+            }
+            else
+            {
+                sortedInstances.push_back(instances[index - sphereCount]);
+            }
+        }
+        objects.swap(sorted);
+        instances.swap(sortedInstances);
+        soa.Build(objects);
+        lights.clear();
+        for (size_t n = 0; n < objects.size(); n++)
+        {
+            if (materials[objects[n].materialId].IsEmissive())
+            {
+                lights.push_back((int)n);
+            }
+        }
+    }
+    //最も近い交点を求める
+    bool Intersect(const Ray &ray, HitRecord &hit, Real tMax = 1000, long *visitedNodes = NULL) const
+    {
+        SoARay soaRay(ray);
+        SphereSoALeaf spheres = {this, &soaRay, &ray, &hit};
+        PrimitiveLeaf<SphereSoALeaf> leaf = {this, spheres, &ray, &hit};
+        return bvh.Intersect(ray, tMax, leaf, visitedNodes);
+    }
+    //最も近い交点を求める(葉の球体を1つずつReal型で判定する比較用)
+    bool IntersectScalar(const Ray &ray, HitRecord &hit, Real tMax = 1000) const
+    {
+        SphereLeaf spheres = {objects.data(), &ray, &hit};
+        PrimitiveLeaf<SphereLeaf> leaf = {this, spheres, &ray, &hit};
+        return bvh.Intersect(ray, tMax, leaf);
+    }
+
+private:
+    std::unordered_map<const MeshBVH *, int> meshIds; //meshesの番号
+
+    //葉の球体を順に調べる
+    struct SphereLeaf
+    {
+        const Sphere *spheres;
+        const Ray *ray;
+        HitRecord *hit;
+
+        bool operator()(int first, int count, Real &tMax) const
+        {
+            STATS_ADD(sphereTests, count);
+            bool isHit = false;
+            for (int n = first; n < first + count; n++)
+            {
+                if (spheres[n].IsHit(*ray, tMax, *hit))
+                {
+                    tMax = hit->t;
+                    hit->objectId = n;
+                    isHit = true;
+                }
+            }
+            return isHit;
+        }
+    };
+    //葉の球体をSIMDで一括判定し、最も近い球体だけReal型で交点を求め直す
+    struct SphereSoALeaf
+    {
+        const Scene *scene;
+        const SoARay *soaRay;
+        const Ray *ray;
+        HitRecord *hit;
+
+        bool operator()(int first, int count, Real &tMax) const
+        {
+            STATS_ADD(sphereTests, count);
+            int n = scene->soa.Nearest(*soaRay, first, count, nextafterf((float)tMax, HUGE_VALF));
+            if (n < 0)
+            {
+                return false;
+            }
+            if (scene->objects[n].IsHit(*ray, tMax, *hit))
+            {
+                tMax = hit->t;
+                hit->objectId = n;
+                return true;
+            }
+            //SIMDとReal型で結果が食い違った場合は1つずつ調べ直す
+            SphereLeaf leaf = {scene->objects.data(), ray, hit};
+            return leaf(first, count, tMax);
+        }
+    };
+    //葉の球体(SphereIntersectorで判定)とインスタンスを調べる
+    //インスタンスに当たった場合、hitの物体番号は~(インスタンスの番号)になる
+    template <class SphereIntersector>
+    struct PrimitiveLeaf
+    {
+        const Scene *scene;
+        SphereIntersector spheres;
+        const Ray *ray;
+        HitRecord *hit;
+
+        bool operator()(int first, int count, Real &tMax) const
+        {
+            if (scene->spheresBefore.empty())
+            {
+                return spheres(first, count, tMax);
+            }
+            //葉の中では球体が先に並んでいる
+            int sphereFirst = scene->spheresBefore[first];
+            int sphereCount = scene->spheresBefore[first + count] - sphereFirst;
+            bool isHit = sphereCount > 0 && spheres(sphereFirst, sphereCount, tMax);
+            int instanceFirst = first - sphereFirst;
+            for (int n = instanceFirst; n < instanceFirst + count - sphereCount; n++)
+            {
+                //光線を物体座標に移して下位BVHを辿る(方向は正規化しないので距離tはそのまま比べられる)
+                const Instance &instance = scene->instances[n];
+                const MeshBVH &mesh = *scene->meshes[instance.mesh];
+                Ray local(instance.toObject.Point(ray->origin), instance.toObject.Direction(ray->direction));
+                int face = mesh.Intersect(local, 0.01, tMax); //球体と同じく0.01より手前は自己交差として除く
+                if (face >= 0)
+                {
+                    hit->t = tMax;
+                    hit->point = ray->origin + ray->direction * tMax;
+                    //法線は逆変換の転置で世界座標に直す
+                    Vector3 a, b, c;
+                    mesh.mesh->Face(face, a, b, c);
+                    Vector3 N = instance.toObject.TransposedDirection((b - a).Cross(c - a));
+                    N.Norm();
+                    hit->frontFace = ray->direction.Dot(N) < 0;
+                    hit->normal = hit->frontFace ? N : -N;
+                    hit->materialId = instance.materialId;
+                    hit->objectId = ~n;
+                    isHit = true;
+                }
+            }
+            return isHit;
+        }
+    };
+};
+
+//二次光線を始点のセルと方向の八分円で並べ替える
+//向きが同じで始点が近い光線を続けて判定すると、BVHの同じノードを辿るのでキャッシュに載ったまま使える
+class RayBinner
+{
+public:
+    //シーン全体の境界ボックスを格子に分ける
+    RayBinner(const Scene &scene)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            lo[a] = 0;
+            scale[a] = 0;
+            if (!scene.bvh.nodes.empty())
+            {
+                const BVHNode &root = scene.bvh.nodes[0];
+                lo[a] = root.boundsMin[a];
+                scale[a] = (1 << RAY_BIN_BITS) / std::max(root.boundsMax[a] - root.boundsMin[a], 1e-30f);
+            }
+        }
+    }
+    //並べ替えのキー(上位が方向の八分円、下位が始点のセルのMorton順)
+    uint32_t Key(const Ray &ray) const
+    {
+        uint32_t octant = (ray.direction.x < 0) | (ray.direction.y < 0) << 1 | (ray.direction.z < 0) << 2;
+        const Real origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+        uint32_t cell = 0;
+        for (int a = 0; a < 3; a++)
+        {
+            int c = std::min(std::max((int)((origin[a] - lo[a]) * scale[a]), 0), (1 << RAY_BIN_BITS) - 1);
+            for (int bit = 0; bit < RAY_BIN_BITS; bit++)
+            {
+                cell |= ((c >> bit) & 1) << (3 * bit + a);
+            }
+        }
+        return octant << (3 * RAY_BIN_BITS) | cell;
+    }
+    //rayAt(0)~rayAt(count-1)の光線をキーの昇順(同じキーは元の順)に並べた番号をorderに求める
+    //(キーは短いので、下位から8ビットずつ安定な計数ソートを繰り返す)
+    template <class RayAt>
+    void Order(int count, RayAt rayAt, std::vector<int> &order)
+    {
+        keys.resize(count);
+        order.resize(count);
+        scratch.resize(count);
+        for (int n = 0; n < count; n++)
+        {
+            keys[n] = Key(rayAt(n));
+            order[n] = n;
+        }
+        for (int shift = 0; shift < 3 * RAY_BIN_BITS + 3; shift += 8)
+        {
+            int start[257] = {0};
+            for (int n = 0; n < count; n++)
+            {
+                start[((keys[n] >> shift) & 255) + 1]++;
+            }
+            for (int b = 0; b < 256; b++)
+            {
+                start[b + 1] += start[b];
+            }
+            for (int n = 0; n < count; n++)
+            {
+                scratch[start[(keys[order[n]] >> shift) & 255]++] = order[n];
+            }
+            order.swap(scratch);
+        }
+    }
+
+private:
+    float lo[3], scale[3];
+    std::vector<uint32_t> keys;
+    std::vector<int> scratch;
+};
+
+// 視界の管理クラス
+class Camera
+{
+private:
+    Vector3 X, Y, Z;      //カメラ基準の方向ベクトル
+    Vector3 screenOrigin; //スクリーンの原点
+
+public:
+    Vector3 eye;       //視点
+    Vector3 lookAt;    //方向
+    double angle;      //アングル
+    int width, height; //スクリーンのピクセル数
+
+    //初期化
+    void Set(Vector3 _eye, Vector3 _lookAt, double _angle, int _width, int _height)
+    {
+        eye = _eye;
+        lookAt = _lookAt;
+        angle = _angle;
+        width = _width;
+        height = _height;
+        SetScreenOrigin();
+    }
+
+    //uv座標の(i,j)の場所の光線を取得する
+    Ray GetScreenRay(int i, int j, Sampler &sampler) const
+    {
+        //-0.5~0.5の乱数を取得する
+        float randA = sampler.Get1D() - 0.5;
+        float randB = sampler.Get1D() - 0.5;
+        //光線の場所を求める
+        //Vector3 rayPos = screenOrigin + X * i + Y * j;
+        Vector3 rayPos = screenOrigin + X * (i + randA) + Y * (j + randB);
+        //光線をリターンする
+        return Ray(eye, (rayPos - eye).Norm());
+    }
+
+private:
+    void SetScreenOrigin()
+    {
+        //スクリーンまでの奥行きを求める
+        double depth = (height / 2) / tan(angle * (PI / 180));
+        //スクリーン中心の座標を求める
+        Vector3 screenCenter = eye + lookAt.Norm() * depth;
+        //図のX,Y,Zベクトルを求める
+        Z = -lookAt.Norm();
+        X = -Vector3(0, 1, 0).Cross(Z).Norm(); //上向きベクトルとZの外積を求めて正規化
+        Y = Z.Cross(X).Norm();                 //ZとXの外積を求めて正規化
+        //スクリーン上での原点の座標を求める
+        screenOrigin = screenCenter - Y * (height / 2) - X * (width / 2);
+    }
+};
+
+//1回の描画でまとめて出力できる画像の種類(AOV)
+//描画ではAOV_BEAUTYを最初に求めるので、乱数の使い方はCastRayだけで描画した場合と同じになる
+enum AOV
+{
+    AOV_BEAUTY,    //経路追跡の結果(CastRay)
+    AOV_NORMAL,    //法線
+    AOV_DEPTH,     //距離(4までを1~0で表す表示用)
+    AOV_ALBEDO,    //物体の色
+    AOV_OUTLINE,   //輪郭線
+    AOV_SECOND,    //2回目以降の反射で届いた光
+    AOV_DISPARITY, //距離の逆数(外れは無限遠の0。表示用のdepthと違い遠くでも潰れないので、ノイズ除去の手掛かりに使う)
+    AOV_COUNT
+};
+const char *const AOV_NAMES[AOV_COUNT] = {"beauty", "normal", "depth", "albedo", "outline", "second", "disparity"};
+
+//名前からAOVを探す(なければAOV_COUNT)
+AOV AOVFromName(const std::string &name)
+{
+    int aov = 0;
+    while (aov < AOV_COUNT && name != AOV_NAMES[aov])
+        aov++;
+    return (AOV)aov;
+}
+
+//描画設定
+struct RenderSettings
+{
+    int width, height;               //横と縦のピクセル数
+    int threadCount;                 //描画に使うスレッド数(0なら全コア)
+    int maxDepth;                    //最大反射回数
+    int rouletteDepth;               //ロシアンルーレットを始める反射回数
+    std::string outputPath;          //出力ファイル
+    ImageFormat outputFormat;        //出力形式
+    bool streamOutput;               //描画中に揃った行から書き出すか？
+    ImageLayout frameLayout;         //フレームバッファの画素の並べ方
+    int samplesPerPixel;             //1ピクセルあたりのサンプル数(段階的描画では0で無制限)
+    bool progressive;                //1サンプルずつ全画面を重ねる段階的描画か？
+    int snapshotPasses;              //段階的描画で途中経過を書き出すパス間隔(0なら使わない)
+    double snapshotSeconds;          //段階的描画で途中経過を書き出す秒間隔(0なら使わない)
+    bool adaptive;                   //誤差の大きいピクセルにだけサンプルを追加する適応的サンプリングか？(samplesPerPixelが上限)
+    int adaptiveMinSamples;          //適応的サンプリングで全ピクセルに最初に打つサンプル数
+    int adaptiveBatch;               //適応的サンプリングで1回に追加するサンプル数
+    float adaptiveThreshold;         //適応的サンプリングを打ち切る相対誤差
+    bool wavefront;                  //反射1回ごとに経路をまとめて処理するウェーブフロント描画か？(CastRayと同じ結果)
+    bool binRays;                    //ウェーブフロント描画で二次光線を始点と方向で並べ替えてから交差判定するか？
+    bool lightSampling;              //拡散面から光る球体へ影の光線を飛ばし、反射方向のサンプリングとMISで合成するか？
+    std::string aovPaths[AOV_COUNT]; //AOVごとの出力ファイル(空なら出力しない。1つでもあればoutputPathの代わりにAOVを描画する)
+    bool denoise;                    //経路追跡の結果を法線・距離・物体の色のAOVを手掛かりにノイズ除去するか？
+
+    RenderSettings()
+    {
+        width = 400;
+        height = 300;
+        threadCount = 0;
+        maxDepth = 4;
+        rouletteDepth = 3;
+        outputPath = "./output1.ppm";
+        outputFormat = FORMAT_P6;
+        streamOutput = false;
+        frameLayout = LAYOUT_ROW_MAJOR;
+        samplesPerPixel = 10;
+        progressive = false;
+        snapshotPasses = 16;
+        snapshotSeconds = 5;
+        adaptive = false;
+        adaptiveMinSamples = 8;
+        adaptiveBatch = 4;
+        adaptiveThreshold = 0.02f;
+        wavefront = false;
+        binRays = false;
+        lightSampling = true;
+        denoise = false;
+    }
+};
+
+//Ctrl-Cで段階的描画を止める要求
+volatile sig_atomic_t renderInterrupted = 0;
+void OnInterrupt(int)
+{
+    renderInterrupted = 1;
+}
+
+//描画範囲(タイル) [x0,x1)×[y0,y1)
+struct Tile
+{
+    int x0, y0, x1, y1;
+};
+
+//ワークスティーリング型のタイルスケジューラ
+//各スレッドは自分のキューの先頭からタイルを取り出し、空になったら他スレッドのキューの末尾から盗む
+class TileScheduler
+{
+public:
+    TileScheduler(int width, int height, int tileSize, int threadCount) : queues(threadCount)
+    {
+        //画面をタイルに分割する
+        std::vector<Tile> tiles;
+        for (int y = 0; y < height; y += tileSize)
+        {
+            for (int x = 0; x < width; x += tileSize)
+            {
+                Tile tile = {x, y, std::min(x + tileSize, width), std::min(y + tileSize, height)};
+                tiles.push_back(tile);
+            }
+        }
+        //連続したタイルをまとめて各スレッドに配る(キャッシュの局所性のため)
+        for (size_t n = 0; n < tiles.size(); n++)
+        {
+            queues[n * threadCount / tiles.size()].tiles.push_back(tiles[n]);
+        }
+    }
+
+    //スレッドthreadIndexが次に描画するタイルを取得する(全て終わったらfalse)
+    bool Pop(int threadIndex, Tile &tile)
+    {
+        //自分のキューから取り出す
+        if (queues[threadIndex].PopFront(tile))
+        {
+            return true;
+        }
+        //他のスレッドのキューから盗む
+        int threadCount = (int)queues.size();
+        for (int n = 1; n < threadCount; n++)
+        {
+            if (queues[(threadIndex + n) % threadCount].PopBack(tile))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<Tile> tiles;
+
+        bool PopFront(Tile &tile)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (tiles.empty())
+                return false;
+            tile = tiles.front();
+            tiles.pop_front();
+            return true;
+        }
+        bool PopBack(Tile &tile)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (tiles.empty())
+                return false;
+            tile = tiles.back();
+            tiles.pop_back();
+            return true;
+        }
+    };
+    std::vector<Queue> queues;
+};
+
+//描画の終わったタイルを数え、全タイルが揃った行から上から順に書き出す
+class TileRowWriter
+{
+public:
+    TileRowWriter(ImageWriter &_writer, const FrameBuffer &_frame, int _tileSize, float _scale, const ToneMapper &_toneMapper)
+        : writer(_writer), frame(_frame), toneMapper(_toneMapper)
+    {
+        tileSize = _tileSize;
+        scale = _scale;
+        int tilesPerRow = (frame.width + tileSize - 1) / tileSize;
+        remaining.assign((frame.height + tileSize - 1) / tileSize, tilesPerRow);
+        nextRow = 0;
+    }
+    //タイルの描画が終わったことを通知する(複数スレッドから呼んでよい)
+    void TileDone(const Tile &tile)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        remaining[tile.y0 / tileSize]--;
+        //上から順に揃った行をまとめて書き出す
+        int row = nextRow;
+        while (row < (int)remaining.size() && remaining[row] == 0)
+        {
+            row++;
+        }
+        if (row > nextRow)
+        {
+            writer.WriteRows(frame, nextRow * tileSize, std::min(row * tileSize, frame.height), scale, toneMapper);
+            nextRow = row;
+        }
+    }
+
+private:
+    ImageWriter &writer;
+    const FrameBuffer &frame;
+    const ToneMapper &toneMapper;
+    int tileSize;
+    float scale;
+    std::vector<int> remaining; //タイル行ごとの未完了タイル数
+    int nextRow;                //次に書き出すタイル行
+    std::mutex lock;
+};
+
+//描画に使うスレッド数を取得する
+int RenderThreadCount()
+{
+    int count = (int)std::thread::hardware_concurrency();
+    return count > 0 ? count : 1;
+}
+
+//ファイルから読み込んだ資源のキャッシュ(バッチ描画でジョブ間に共有する)
+//同じパスは一度だけ読み込み、ファイルの更新時刻か大きさが変わっていれば読み込み直す
+template <class T>
+class FileCache
+{
+public:
+    //pathの資源を取得する(読み込みはload(T&, path)で行い、失敗したらNULL)
+    template <class Loader>
+    std::shared_ptr<const T> Get(const std::string &path, Loader load)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+        {
+            fprintf(stderr, "cannot open %s\n", path.c_str());
+            return NULL;
+        }
+        //表の参照と追加の間だけ全体を排他し、読み込みはファイルごとに排他する
+        //(同じファイルは1回だけ読み込み、別のファイルは並行して読み込める。要素への参照は追加しても無効にならない)
+        Entry *found;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            found = &entries[path];
+        }
+        Entry &entry = *found;
+        std::lock_guard<std::mutex> guard(entry.lock);
+        if (entry.value == NULL || entry.modified != st.st_mtime || entry.size != st.st_size)
+        {
+            std::shared_ptr<T> value = std::make_shared<T>();
+            if (!load(*value, path))
+            {
+                return NULL;
+            }
+            entry.value = value;
+            entry.modified = st.st_mtime;
+            entry.size = st.st_size;
+        }
+        return entry.value;
+    }
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<const T> value;
+        time_t modified;
+        off_t size;
+        std::mutex lock; //このファイルの読み込み
+    };
+    std::unordered_map<std::string, Entry> entries;
+    std::mutex lock;
+};
+
+//背景の環境光のキャッシュ(画像はメモリマップしたまま共有する)
+FileCache<EnvironmentLight> environmentCache;
+std::shared_ptr<const EnvironmentLight> LoadEnvironment(const std::string &path)
+{
+    return environmentCache.Get(path, [](EnvironmentLight &environment, const std::string &p) {
+        return environment.Load(p.c_str());
+    });
+}
+
+//シーンファイルを1行ずつ読む字句解析器
+//行は「キーワード 引数...」で、#から行末まではコメント
+//数値はstrtodを使わずに直接変換する(ロケールの参照や文字列の複製をしないため、大きなファイルでも速い)
+class SceneReader
+{
+public:
+    int line; //現在の行番号(1から)
+
+    SceneReader(const MappedFile &file) : line(1), p((const char *)file.data), end((const char *)file.data + file.size) {}
+
+    //次の空でない行の先頭に進む(ファイル末尾ならfalse)
+    bool NextLine()
+    {
+        while (true)
+        {
+            SkipSpace();
+            if (p == end)
+            {
+                return false;
+            }
+            if (*p == '#')
+            {
+                while (p < end && *p != '\n')
+                    p++;
+            }
+            else if (*p == '\n')
+            {
+                p++;
+                line++;
+            }
+            else
+            {
+                return true;
+            }
+        }
+    }
+    //行の残りを読み飛ばす
+    void SkipLine()
+    {
+        while (p < end && *p != '\n')
+            p++;
+    }
+    //行の残りが空白かコメントだけならtrue
+    bool EndLine()
+    {
+        SkipSpace();
+        return p == end || *p == '\n' || *p == '#';
+    }
+    //空白で区切られた次の語を読む
+    bool Word(std::string &word)
+    {
+        SkipSpace();
+        const char *begin = p;
+        while (p < end && !IsDelimiter(*p))
+            p++;
+        word.assign(begin, p - begin);
+        return p > begin;
+    }
+    //次の数値を読む([+-]数字[.数字][e[+-]数字])
+    bool Number(double &value)
+    {
+        SkipSpace();
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+        {
+            negative = *p++ == '-';
+        }
+        //仮数は19桁まで整数で集め、それより下の桁は指数にだけ反映する
+        uint64_t mantissa = 0;
+        int exponent = 0, digits = 0, significant = 0;
+        for (; p < end && IsDigit(*p); p++, digits++)
+        {
+            if (significant < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                significant += mantissa != 0;
+            }
+            else
+            {
+                exponent++;
+            }
+        }
+        if (p < end && *p == '.')
+        {
+            for (p++; p < end && IsDigit(*p); p++, digits++)
+            {
+                if (significant < 19)
+                {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    significant += mantissa != 0;
+                    exponent--;
+                }
+            }
+        }
+        if (digits == 0)
+        {
+            return false;
+        }
+        if (p < end && (*p == 'e' || *p == 'E'))
+        {
+            p++;
+            bool negativeExponent = false;
+            if (p < end && (*p == '-' || *p == '+'))
+            {
+                negativeExponent = *p++ == '-';
+            }
+            if (p == end || !IsDigit(*p))
+            {
+                return false;
+            }
+            int e = 0;
+            for (; p < end && IsDigit(*p); p++)
+            {
+                e = std::min(e * 10 + (*p - '0'), 10000);
+            }
+            exponent += negativeExponent ? -e : e;
+        }
+        value = Scale((double)mantissa, exponent);
+        if (negative)
+        {
+            value = -value;
+        }
+        return p == end || IsDelimiter(*p);
+    }
+    //次の整数を読む
+    bool Integer(int &value)
+    {
+        double v;
+        if (!Number(v) || v != floor(v) || fabs(v) > 2147483647.0)
+        {
+            return false;
+        }
+        value = (int)v;
+        return true;
+    }
+    //次の3つの数値をベクトルとして読む
+    bool Vector(Vector3 &v)
+    {
+        double x, y, z;
+        if (!Number(x) || !Number(y) || !Number(z))
+        {
+            return false;
+        }
+        v.Set(x, y, z);
+        return true;
+    }
+
+private:
+    const char *p, *end;
+
+    static bool IsDigit(char c) { return (unsigned)(c - '0') < 10; }
+    static bool IsDelimiter(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '#'; }
+    void SkipSpace()
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+    }
+    //value×10^exponentを求める(10^22までは正確に表せるので表を引く)
+    static double Scale(double value, int exponent)
+    {
+        static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                         1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+        if (value == 0)
+        {
+            return 0;
+        }
+        while (exponent > 22)
+        {
+            value *= 1e22;
+            exponent -= 22;
+        }
+        while (exponent < -22)
+        {
+            value /= 1e22;
+            exponent += 22;
+        }
+        return exponent >= 0 ? value * powers[exponent] : value / powers[-exponent];
+    }
+};
+
+//OBJ形式のメッシュを読み込む(vとfの行だけを使い、多角形は扇形に三角形へ分ける)
+//テキストを解析するので遅い。大きなモデルは--convert-meshでバイナリ形式にしておく
+bool LoadObj(Mesh &mesh, const char *path)
+{
+    MappedFile file;
+    if (!file.Open(path))
+    {
+        return false;
+    }
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices, polygon;
+    std::string keyword, corner;
+    SceneReader reader(file);
+    while (reader.NextLine())
+    {
+        reader.Word(keyword);
+        if (keyword == "v")
+        {
+            double x, y, z;
+            if (!reader.Number(x) || !reader.Number(y) || !reader.Number(z))
+            {
+                fprintf(stderr, "%s:%d: invalid vertex\n", path, reader.line);
+                return false;
+            }
+            vertices.push_back((float)x);
+            vertices.push_back((float)y);
+            vertices.push_back((float)z);
+        }
+        else if (keyword == "f")
+        {
+            //頂点は「頂点/テクスチャ座標/法線」の先頭の番号だけを使う(負の番号は直前の頂点からの相対)
+            long vertexCount = (long)(vertices.size() / 3);
+            polygon.clear();
+            while (!reader.EndLine() && reader.Word(corner))
+            {
+                long index = strtol(corner.c_str(), NULL, 10);
+                if (index < 0)
+                {
+                    index += vertexCount + 1;
+                }
+                if (index < 1 || index > vertexCount)
+                {
+                    fprintf(stderr, "%s:%d: invalid face\n", path, reader.line);
+                    return false;
+                }
+                polygon.push_back((uint32_t)(index - 1));
+            }
+            if (polygon.size() < 3)
+            {
+                fprintf(stderr, "%s:%d: invalid face\n", path, reader.line);
+                return false;
+            }
+            for (size_t n = 1; n + 1 < polygon.size(); n++)
+            {
+                indices.push_back(polygon[0]);
+                indices.push_back(polygon[n]);
+                indices.push_back(polygon[n + 1]);
+            }
+        }
+        reader.SkipLine();
+    }
+    mesh.Assign(std::move(vertices), std::move(indices));
+    return true;
+}
+
+//メッシュのキャッシュ(拡張子が.objならOBJ形式、それ以外はバイナリ形式として読み込む)
+FileCache<Mesh> meshCache;
+std::shared_ptr<const Mesh> LoadMesh(const std::string &path)
+{
+    return meshCache.Get(path, [](Mesh &mesh, const std::string &p) {
+        if (p.size() >= 4 && p.compare(p.size() - 4, 4, ".obj") == 0)
+        {
+            return LoadObj(mesh, p.c_str());
+        }
+        return mesh.Load(p.c_str());
+    });
+}
+
+//メッシュの下位BVHのキャッシュ(同じファイルを置いたインスタンスとジョブは1つの下位BVHを共有する)
+FileCache<MeshBVH> meshBVHCache;
+std::shared_ptr<const MeshBVH> LoadMeshBVH(const std::string &path)
+{
+    return meshBVHCache.Get(path, [](MeshBVH &blas, const std::string &p) {
+        std::shared_ptr<const Mesh> mesh = LoadMesh(p);
+        if (mesh == NULL)
+        {
+            return false;
+        }
+        blas.Build(mesh);
+        return true;
+    });
+}
+
+class World
+{
+public:
+    //カメラ
+    Camera camera;
+    //マテリアルと球体オブジェクト(読み込み後は変更しないので、複製したWorld間で共有する)
+    std::shared_ptr<const Scene> scene;
+    //描画設定
+    RenderSettings settings;
+    //背景画像のファイル(描画を始めるときにLoadBackgroundで読み込む。空なら背景画像なし)
+    std::string backgroundPath;
+    //背景の環境光(読み込む前と読み込めなかった場合はNULL)
+    std::shared_ptr<const EnvironmentLight> environment;
+    //直前の段階的描画がCtrl-Cで途中で止められたか？
+    bool interrupted;
+
+    //初期化
+    World() : interrupted(false)
+    {
+        //カメラを設定
+        camera.Set(Vector3(0, 0, 0), Vector3(0, 0, -1), 45, settings.width, settings.height); //座標、視線方向、仰角、解像度
+        std::shared_ptr<Scene> builtIn = std::make_shared<Scene>();
+        //マテリアルを設定
+        int mat1 = builtIn->AddMaterial(Color::FromByte(0, 200, 255), 0.5, DIFFUSE);
+        int mat2 = builtIn->AddMaterial(Color::FromByte(255, 100, 200), 0.5, DIFFUSE);
+        int mat3 = builtIn->AddMaterial(Color::FromByte(100, 255, 100), 0.5, DIFFUSE);
+        int mirror = builtIn->AddMaterial(Color::FromByte(255, 255, 150), 0.5, REFLECTION);
+        //オブジェクトを設定
+        builtIn->AddSphere(Vector3(2, 0, -3), 1, mat1);
+        builtIn->AddSphere(Vector3(0, 0, -3), 1, mat2);
+        builtIn->AddSphere(Vector3(-2, 0, -3), 1, mat3);
+        builtIn->AddSphere(Vector3(2, -501, 2), 500, mirror); //地面
+        //加速構造を構築
+        builtIn->Build();
+        scene = builtIn;
+        //背景を登録(描画しない実行では読み込まない)
+        backgroundPath = "./backImage.ppm";
+    }
+    //背景画像をまだ読み込んでいなければ読み込む(キャッシュするので、複製したWorldでも読み込みは1回)
+    void LoadBackground()
+    {
+        if (environment == NULL && !backgroundPath.empty())
+        {
+            environment = LoadEnvironment(backgroundPath);
+        }
+    }
+    //シーンファイルを読み込んで、カメラ・物体・描画設定を置き換える
+    //読み込みに失敗した場合はfalseを返し、世界は変更しない
+    //  resolution 幅 高さ
+    //  samples サンプル数
+    //  depth 最大反射回数
+    //  camera 視点x y z 方向x y z 仰角
+    //  background 画像ファイル(.ppm|.pfm)
+    //  material 名前 diffuse|reflection|refraction 赤 緑 青(0~255) アルベド
+    //  material 名前 light 赤 緑 青(0~255) 強さ  (反射しない光源)
+    //  sphere 中心x y z 半径 マテリアル名
+    //  mesh メッシュファイル(.objかバイナリ形式) マテリアル名 [位置x y z [回転軸x y z 角度 [倍率]]]
+    //       (同じファイルは何度置いても1つの下位BVHを共有する)
+    bool LoadScene(const char *path)
+    {
+        STATS_PHASE(PHASE_SCENE_LOAD);
+        Timer timer;
+        MappedFile file;
+        if (!file.Open(path))
+        {
+            return false;
+        }
+        std::shared_ptr<Scene> newScene = std::make_shared<Scene>();
+        RenderSettings newSettings = settings;
+        Vector3 eye = camera.eye, lookAt = camera.lookAt;
+        double angle = camera.angle;
+        std::string backPath;
+        std::unordered_map<std::string, int> materialIds;
+        //球体の行は30バイト以上あるので、その数だけ先に確保して再確保を避ける
+        newScene->objects.reserve(file.size / 30);
+        SceneReader reader(file);
+        std::string keyword, name, type;
+        while (reader.NextLine())
+        {
+            bool ok = reader.Word(keyword);
+            if (keyword == "sphere")
+            {
+                Vector3 center;
+                double radius;
+                ok = reader.Vector(center) && reader.Number(radius) && reader.Word(name) && radius > 0;
+                std::unordered_map<std::string, int>::const_iterator found = materialIds.find(name);
+                if (ok && found == materialIds.end())
+                {
+                    fprintf(stderr, "%s:%d: unknown material %s\n", path, reader.line, name.c_str());
+                    return false;
+                }
+                if (ok)
+                {
+                    newScene->AddSphere(center, radius, found->second);
+                }
+            }
+            else if (keyword == "mesh")
+            {
+                std::string meshPath;
+                Vector3 position, axis(0, 1, 0);
+                double degrees = 0, scale = 1;
+                ok = reader.Word(meshPath) && reader.Word(name);
+                if (ok && !reader.EndLine())
+                {
+                    ok = reader.Vector(position);
+                }
+                if (ok && !reader.EndLine())
+                {
+                    ok = reader.Vector(axis) && reader.Number(degrees);
+                }
+                if (ok && !reader.EndLine())
+                {
+                    ok = reader.Number(scale) && scale > 0;
+                }
+                std::unordered_map<std::string, int>::const_iterator found = materialIds.find(name);
+                if (ok && found == materialIds.end())
+                {
+                    fprintf(stderr, "%s:%d: unknown material %s\n", path, reader.line, name.c_str());
+                    return false;
+                }
+                std::shared_ptr<const MeshBVH> mesh;
+                if (ok && (mesh = LoadMeshBVH(meshPath)) == NULL)
+                {
+                    return false;
+                }
+                if (ok)
+                {
+                    ok = newScene->AddMesh(mesh, found->second, Transform::Make(position, axis, degrees, scale)) >= 0;
+                }
+            }
+            else if (keyword == "material")
+            {
+                double r = 0, g = 0, b = 0, albedo = 0;
+                ok = reader.Word(name) && reader.Word(type) && reader.Number(r) && reader.Number(g) && reader.Number(b) && reader.Number(albedo);
+                reflectionType materialType = DIFFUSE;
+                Color color(r / GROSS, g / GROSS, b / GROSS), emission(0, 0, 0);
+                if (type == "reflection")
+                {
+                    materialType = REFLECTION;
+                }
+                else if (type == "refraction")
+                {
+                    materialType = REFRACTION;
+                }
+                else if (type == "light")
+                {
+                    //光源は反射せず、最後の数値を明るさの倍率に使う
+                    emission = color * albedo;
+                    color.Set(0, 0, 0);
+                    albedo = 0;
+                }
+                else if (type != "diffuse")
+                {
+                    ok = false;
+                }
+                if (ok)
+                {
+                    materialIds[name] = newScene->AddMaterial(color, albedo, materialType, emission);
+                }
+            }
+            else if (keyword == "camera")
+            {
+                ok = reader.Vector(eye) && reader.Vector(lookAt) && reader.Number(angle);
+            }
+            else if (keyword == "resolution")
+            {
+                ok = reader.Integer(newSettings.width) && reader.Integer(newSettings.height) && newSettings.width > 0 && newSettings.height > 0;
+            }
+            else if (keyword == "samples")
+            {
+                ok = reader.Integer(newSettings.samplesPerPixel) && newSettings.samplesPerPixel >= 1;
+            }
+            else if (keyword == "depth")
+            {
+                ok = reader.Integer(newSettings.maxDepth) && newSettings.maxDepth >= 0;
+            }
+            else if (keyword == "background")
+            {
+                ok = reader.Word(backPath);
+            }
+            else
+            {
+                fprintf(stderr, "%s:%d: unknown keyword %s\n", path, reader.line, keyword.c_str());
+                return false;
+            }
+            if (!ok || !reader.EndLine())
+            {
+                fprintf(stderr, "%s:%d: invalid %s\n", path, reader.line, keyword.c_str());
+                return false;
+            }
+        }
+        double parseTime = timer.Seconds();
+        //読み込んだ配列からそのまま加速構造を構築する
+        newScene->Build();
+        scene = newScene;
+        settings = newSettings;
+        camera.Set(eye, lookAt, angle, settings.width, settings.height);
+        if (!backPath.empty())
+        {
+            backgroundPath = backPath;
+            environment = NULL;
+        }
+        fprintf(stderr, "scene: %zu spheres, %zu instances of %zu meshes (%zu triangles), parse %.3fs, build %.3fs\n", scene->objects.size(), scene->instances.size(), scene->meshes.size(), scene->TriangleCount(), parseTime, timer.Seconds() - parseTime);
+        return true;
+    }
+    //ピクセル(x,y)のn番目のサンプルをCastRayで経路追跡する(ベンチマーク用)
+    Color TraceSample(int x, int y, int n, Sampler &sampler) const
+    {
+        sampler.StartPixelSample(x, y, n);
+        return CastRay(camera.GetScreenRay(x, y, sampler), sampler);
+    }
+    //画像生成(出力ファイルに書き出せなかったらfalse)
+    bool GetImage()
+    {
+        //解像度がシーンの読み込み後に変更されていてもスクリーンを合わせる
+        camera.Set(camera.eye, camera.lookAt, camera.angle, settings.width, settings.height);
+        LoadBackground();
+        if (HasAOVs() || settings.denoise)
+        {
+            return RenderAOVs();
+        }
+        //描画結果を格納するフレームバッファ
+        FrameBuffer frame(settings.width, settings.height, settings.frameLayout);
+        interrupted = false;
+        if (settings.progressive)
+        {
+            return RenderProgressive(frame, interrupted);
+        }
+        if (settings.adaptive)
+        {
+            return RenderAdaptive(frame);
+        }
+        ToneMapper toneMapper;
+        float scale = 1.0f / settings.samplesPerPixel;
+        //出力ファイルを開く
+        ImageWriter writer;
+        if (!writer.Open(settings.outputPath.c_str(), settings.outputFormat, settings.width, settings.height))
+        {
+            return false;
+        }
+        //P3は1行ずつ書式変換するだけなので描画中には書き出さない
+        bool stream = settings.streamOutput && settings.outputFormat != FORMAT_P3;
+        TileRowWriter rowWriter(writer, frame, TILE_SIZE, scale, toneMapper);
+        RenderPass(frame, 0, settings.samplesPerPixel, stream ? &rowWriter : NULL);
+        //最後にまとめてトーンマップ・ガンマ変換して書き出す
+        if (!stream)
+        {
+            writer.WriteRows(frame, 0, settings.height, scale, toneMapper);
+        }
+        return writer.Close();
+    }
+    //出力するAOVが指定されているか？
+    bool HasAOVs() const
+    {
+        for (int aov = 0; aov < AOV_COUNT; aov++)
+        {
+            if (!settings.aovPaths[aov].empty())
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    //pathに書き出す形式(--outputのファイルは指定どおり、AOVのファイルは拡張子から決め、--asciiならPPMをテキストにする)
+    ImageFormat OutputFormat(const std::string &path) const
+    {
+        if (path == settings.outputPath)
+        {
+            return settings.outputFormat;
+        }
+        ImageFormat format = ImageFormatFromPath(path);
+        return format == FORMAT_P6 && settings.outputFormat == FORMAT_P3 ? FORMAT_P3 : format;
+    }
+
+    //framesのうち大きさを設定したAOVを1回の描画でまとめて求める(framesはAOV_COUNT個)
+    //カメラ光線の交差判定はサンプルごとに1回だけ行い、その交点から各AOVを求める
+    void RenderAOVFrames(std::vector<FrameBuffer> &frames) const
+    {
+        int sampleCount = settings.samplesPerPixel;
+        ForEachTile([this, &frames, sampleCount](const Tile &tile) {
+            Sampler sampler;
+            for (int y = tile.y0; y < tile.y1; y++)
+            {
+                for (int x = tile.x0; x < tile.x1; x++)
+                {
+                    for (int n = 0; n < sampleCount; n++)
+                    {
+                        sampler.StartPixelSample(x, y, n);
+                        Ray cameraRay = camera.GetScreenRay(x, y, sampler);
+                        HitRecord hit;
+                        if (!Intersect(cameraRay, hit))
+                        {
+                            hit.materialId = -1;
+                        }
+                        for (int aov = 0; aov < AOV_COUNT; aov++)
+                        {
+                            if (frames[aov].width > 0)
+                            {
+                                frames[aov].Add(x, y, ShadeAOV((AOV)aov, cameraRay, hit, sampler));
+                            }
+                        }
+                    }
+                }
+            }
+        });
+    }
+    //RenderAOVFramesで求めたbeautyのノイズを、法線・距離・物体の色のAOVを手掛かりに除く
+    void Denoise(std::vector<FrameBuffer> &frames) const
+    {
+        Denoiser denoiser;
+        int threadCount = settings.threadCount > 0 ? settings.threadCount : RenderThreadCount();
+        denoiser.Run(frames[AOV_BEAUTY], frames[AOV_NORMAL], frames[AOV_DISPARITY], frames[AOV_ALBEDO], 1.0f / settings.samplesPerPixel, threadCount);
+    }
+
+private:
+    //指定された全てのAOVを1回の描画で求め、それぞれのファイルに書き出す
+    //ノイズ除去する場合は手掛かりのAOVも求め、除去したbeautyを書き出す(--aov beautyがなければoutputPathへ)
+    //(段階的描画・適応的サンプリング・ウェーブフロント描画との組み合わせはParseRenderOptionsで断る)
+    bool RenderAOVs() const
+    {
+        std::vector<FrameBuffer> frames(AOV_COUNT);
+        std::string paths[AOV_COUNT];
+        for (int aov = 0; aov < AOV_COUNT; aov++)
+        {
+            paths[aov] = settings.aovPaths[aov];
+            bool guide = aov == AOV_BEAUTY || aov == AOV_NORMAL || aov == AOV_DISPARITY || aov == AOV_ALBEDO;
+            if (!paths[aov].empty() || (settings.denoise && guide))
+            {
+                frames[aov].Resize(settings.width, settings.height, settings.frameLayout);
+            }
+        }
+        if (settings.denoise && paths[AOV_BEAUTY].empty())
+        {
+            paths[AOV_BEAUTY] = settings.outputPath;
+        }
+        RenderAOVFrames(frames);
+        if (settings.denoise)
+        {
+            Timer timer;
+            Denoise(frames);
+            fprintf(stderr, "denoise: %.3fs\n", timer.Seconds());
+        }
+        bool ok = true;
+        for (int aov = 0; aov < AOV_COUNT; aov++)
+        {
+            const std::string &path = paths[aov];
+            if (path.empty())
+            {
+                continue;
+            }
+            ImageWriter writer;
+            if (!writer.Open(path.c_str(), OutputFormat(path), settings.width, settings.height))
+            {
+                ok = false;
+                continue;
+            }
+            writer.WriteRows(frames[aov], 0, settings.height, 1.0f / settings.samplesPerPixel, ToneMapper());
+            ok = writer.Close() && ok;
+        }
+        return ok;
+    }
+    //全画面について各ピクセルのサンプル[firstSample, firstSample + sampleCount)を描画する
+    //タイルに分割して全スレッドで描画し、rowWriterがあれば揃った行から書き出す
+    void RenderPass(FrameBuffer &frame, int firstSample, int sampleCount, TileRowWriter *rowWriter) const
+    {
+        ForEachTile([this, &frame, rowWriter, firstSample, sampleCount](const Tile &tile) {
+            RenderTile(tile, frame, firstSample, sampleCount);
+            if (rowWriter != NULL)
+            {
+                rowWriter->TileDone(tile);
+            }
+        });
+    }
+    //画面をタイルに分割し、全スレッドで各タイルについてrenderTileを呼ぶ
+    template <class TileFunc>
+    void ForEachTile(TileFunc renderTile) const
+    {
+        STATS_PHASE(PHASE_RENDER);
+        int threadCount = settings.threadCount > 0 ? settings.threadCount : RenderThreadCount();
+        TileScheduler scheduler(settings.width, settings.height, TILE_SIZE, threadCount);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threadCount; t++)
+        {
+            workers.push_back(std::thread([&scheduler, &renderTile, t]() {
+                //交差判定は世界を書き換えないので、全スレッドで共有して読み込む
+                Tile tile;
+#if defined(RENDER_STATS)
+                Timer timer;
+                int tileCount = 0;
+                while (scheduler.Pop(t, tile))
+                {
+                    renderTile(tile);
+                    tileCount++;
+                }
+                renderStats.AddTiles(t, tileCount, timer.Seconds());
+#else
+                while (scheduler.Pop(t, tile))
+                {
+                    renderTile(tile);
+                }
+#endif
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); t++)
+        {
+            workers[t].join();
+        }
+    }
+    //適応的サンプリング：全ピクセルに最低数のサンプルを打った後、
+    //輝度の相対誤差が閾値を超えるピクセルにだけ上限までサンプルを追加していく
+    bool RenderAdaptive(FrameBuffer &frame) const
+    {
+        PixelStats stats(settings.width, settings.height);
+        int maxSamples = std::max(settings.samplesPerPixel, 1);
+        int batch = std::min(settings.adaptiveMinSamples, maxSamples);
+        for (int round = 0;; round++)
+        {
+            //このラウンドでサンプルを追加したピクセル数
+            std::atomic<long> active(0);
+            ForEachTile([this, &frame, &stats, &active, batch, maxSamples](const Tile &tile) {
+                long count = 0;
+                Sampler sampler;
+                for (int y = tile.y0; y < tile.y1; y++)
+                {
+                    for (int x = tile.x0; x < tile.x1; x++)
+                    {
+                        int first = stats.Count(x, y);
+                        if (first > 0 && (first >= maxSamples || stats.RelativeError(x, y) <= settings.adaptiveThreshold))
+                        {
+                            continue;
+                        }
+                        //サンプル番号は続きから振るので、結果はスレッド数や順序に依らない
+                        for (int n = first; n < std::min(first + batch, maxSamples); n++)
+                        {
+                            Color color = RenderSample(x, y, n, sampler);
+                            frame.Add(x, y, color);
+                            stats.Add(x, y, color.Luminance());
+                        }
+                        count++;
+                    }
+                }
+                active += count;
+            });
+            if (active == 0)
+            {
+                break;
+            }
+            batch = settings.adaptiveBatch;
+            fprintf(stderr, "\rround %d: %ld pixels", round, (long)active);
+        }
+        //ピクセルごとにサンプル数で割って平均にしてから書き出す(上限で打ち切ったピクセルもあるので、実際に取ったサンプル数を数える)
+        long totalSamples = 0;
+        for (int y = 0; y < settings.height; y++)
+        {
+            for (int x = 0; x < settings.width; x++)
+            {
+                Color &p = frame.image.Pixel(x, y);
+                p = p / stats.Count(x, y);
+                totalSamples += stats.Count(x, y);
+            }
+        }
+        fprintf(stderr, "\radaptive: %.2f spp on average (max %d)\n", (double)totalSamples / ((long)settings.width * settings.height), maxSamples);
+        ImageWriter writer;
+        if (!writer.Open(settings.outputPath.c_str(), settings.outputFormat, settings.width, settings.height))
+        {
+            return false;
+        }
+        writer.WriteRows(frame, 0, settings.height, 1.0f, ToneMapper());
+        return writer.Close();
+    }
+    //段階的描画：1パスごとに全ピクセルへ1サンプルずつ足し込み、一定間隔で途中経過を書き出す
+    //Ctrl-Cで止めると、描画中のパスを終えてからその時点の画像を書き出して終了する
+    //stoppedには、Ctrl-Cで予定のパス数より前に止めたかを返す
+    bool RenderProgressive(FrameBuffer &frame, bool &stopped) const
+    {
+        //バッチ描画中なら止める要求をそのまま引き継ぎ、終わったら元のハンドラに戻す
+        //単独の描画では、前の描画で残った要求を消してから始める
+        void (*previous)(int) = signal(SIGINT, OnInterrupt);
+        if (previous != OnInterrupt)
+        {
+            renderInterrupted = 0;
+        }
+        Timer timer;
+        double lastSnapshot = 0;
+        int passes = 0;
+        while ((settings.samplesPerPixel <= 0 || passes < settings.samplesPerPixel) && !renderInterrupted)
+        {
+            RenderPass(frame, passes, 1, NULL);
+            passes++;
+            double seconds = timer.Seconds();
+            bool byPasses = settings.snapshotPasses > 0 && passes % settings.snapshotPasses == 0;
+            bool bySeconds = settings.snapshotSeconds > 0 && seconds - lastSnapshot >= settings.snapshotSeconds;
+            if (byPasses || bySeconds)
+            {
+                WriteSnapshot(frame, passes);
+                lastSnapshot = seconds;
+                fprintf(stderr, "\r%d spp (%.1f s)", passes, seconds);
+            }
+        }
+        stopped = settings.samplesPerPixel <= 0 || passes < settings.samplesPerPixel;
+        bool written = WriteSnapshot(frame, passes);
+        fprintf(stderr, "\r%d spp (%.1f s)%s\n", passes, timer.Seconds(), stopped ? " interrupted" : "");
+        signal(SIGINT, previous);
+        return written;
+    }
+    //その時点の平均を書き出す(途中の状態が見えないよう一時ファイルに書いてから置き換える)
+    bool WriteSnapshot(const FrameBuffer &frame, int samples) const
+    {
+        if (samples == 0)
+        {
+            return false;
+        }
+        std::string temporary = settings.outputPath + ".tmp";
+        ImageWriter writer;
+        if (!writer.Open(temporary.c_str(), settings.outputFormat, frame.width, frame.height))
+        {
+            return false;
+        }
+        writer.WriteRows(frame, 0, frame.height, 1.0f / samples, ToneMapper());
+        return writer.Close() && rename(temporary.c_str(), settings.outputPath.c_str()) == 0;
+    }
+    //タイル内のピクセルのサンプル[firstSample, firstSample + sampleCount)を描画してフレームバッファに足し込む
+    void RenderTile(const Tile &tile, FrameBuffer &frame, int firstSample, int sampleCount) const
+    {
+        if (settings.wavefront)
+        {
+            RenderTileWavefront(tile, frame, firstSample, sampleCount);
+            return;
+        }
+        Sampler sampler;
+        for (int y = tile.y0; y < tile.y1; y++)
+        {
+            for (int x = tile.x0; x < tile.x1; x++)
+            {
+                //レイを飛ばす
+                for (int n = firstSample; n < firstSample + sampleCount; n++)
+                {
+                    frame.Add(x, y, RenderSample(x, y, n, sampler));
+                }
+            }
+        }
+    }
+    //光源サンプリングの結果
+    struct LightSample
+    {
+        Ray shadowRay;  //交点から光源へ向かう光線
+        int objectId;   //狙った光源の球体の番号(環境光なら-1)
+        Color radiance; //遮られていなければ届く光(MISの重み込み、経路のスループットは掛ける前)
+    };
+    //ウェーブフロント描画で追跡中の経路
+    struct PathState
+    {
+        Ray ray;
+        Color throughput;  //これまでの反射で掛かった重み
+        Sampler sampler;   //この経路の乱数列
+        int slot;          //結果を書き込む位置
+        Vector3 lastPoint; //直前の反射の位置
+        float bsdfPdf;     //直前の反射で方向を選んだ確率密度(CastRayと同じ)
+    };
+    //ウェーブフロント描画でまとめて判定する影の光線
+    struct ShadowState
+    {
+        LightSample light;
+        Color throughput; //経路のスループット(CastRayと同じ式で掛けて足すため別に持つ)
+        int slot;         //結果を書き込む位置
+    };
+    //ウェーブフロント描画：タイル内の全サンプルのカメラ光線をまとめて生成し、反射1回ごとに
+    //「全経路を交差判定 → 交差した経路をマテリアルごとに並べ替え → マテリアルごとに反射を計算して次の経路を作る」を繰り返す
+    //経路ごとの乱数の使い方と光を足す順はCastRayと同じなので、結果もCastRayと一致する
+    //(光源サンプリングを使う場合、積和演算の融合のされ方が呼び出し元で変わるので、ビット単位で一致するのは-ffp-contract=offでビルドしたときだけ)
+    void RenderTileWavefront(const Tile &tile, FrameBuffer &frame, int firstSample, int sampleCount) const
+    {
+        int width = tile.x1 - tile.x0;
+        int total = width * (tile.y1 - tile.y0) * sampleCount;
+        int materialCount = (int)scene->materials.size();
+        std::vector<PathState> paths, next;
+        std::vector<ShadowState> shadows;
+        std::vector<HitRecord> hits;
+        std::vector<int> queueStart(materialCount + 1), queue;
+        std::vector<Color> results;
+        std::vector<int> order;
+        RayBinner binner(*scene);
+        paths.reserve(std::min(total, WAVEFRONT_SIZE));
+        next.reserve(paths.capacity());
+        //(ピクセル, サンプル)の組を先頭からWAVEFRONT_SIZEずつ処理する
+        for (int begin = 0; begin < total; begin += WAVEFRONT_SIZE)
+        {
+            int end = std::min(begin + WAVEFRONT_SIZE, total);
+            //カメラ光線を生成する
+            paths.clear();
+            results.assign(end - begin, Color(0, 0, 0));
+            for (int slot = begin; slot < end; slot++)
+            {
+                int pixel = slot / sampleCount;
+                Sampler sampler;
+                sampler.StartPixelSample(tile.x0 + pixel % width, tile.y0 + pixel / width, firstSample + slot % sampleCount);
+                Ray ray = camera.GetScreenRay(tile.x0 + pixel % width, tile.y0 + pixel / width, sampler);
+                PathState path = {ray, Color(1, 1, 1), sampler, slot - begin, Vector3(), 0};
+                paths.push_back(path);
+            }
+            for (int depth = 0; depth < settings.maxDepth && !paths.empty(); depth++)
+            {
+                //全経路の交差判定をまとめて行い、外れた経路は背景の色で終える
+                hits.resize(paths.size());
+                std::fill(queueStart.begin(), queueStart.end(), 0);
+                for (size_t n = 0; n < paths.size(); n++)
+                {
+                    PathState &path = paths[n];
+                    if (Intersect(path.ray, hits[n]))
+                    {
+                        results[path.slot] = results[path.slot] + Emission(hits[n], path.lastPoint, path.bsdfPdf) * path.throughput;
+                        queueStart[hits[n].materialId + 1]++;
+                    }
+                    else
+                    {
+                        results[path.slot] = results[path.slot] + Background(path.ray, path.bsdfPdf) * path.throughput;
+                        hits[n].materialId = -1;
+                    }
+                }
+                //交差した経路の番号をマテリアルごとのキューに並べる(計数ソート)
+                for (int m = 0; m < materialCount; m++)
+                {
+                    queueStart[m + 1] += queueStart[m];
+                }
+                queue.resize(queueStart[materialCount]);
+                std::vector<int> fill(queueStart.begin(), queueStart.end() - 1);
+                for (size_t n = 0; n < paths.size(); n++)
+                {
+                    if (hits[n].materialId >= 0)
+                    {
+                        queue[fill[hits[n].materialId]++] = (int)n;
+                    }
+                }
+                //キューごとに同じマテリアルの反射をまとめて計算し、次の反射の経路と影の光線を作る
+                next.clear();
+                shadows.clear();
+                for (int m = 0; m < materialCount; m++)
+                {
+                    const Material &material = scene->materials[m];
+                    for (int k = queueStart[m]; k < queueStart[m + 1]; k++)
+                    {
+                        PathState &path = paths[queue[k]];
+                        path.throughput = path.throughput * material.color * material.albedo;
+                        if (path.throughput.Max() <= 0)
+                        {
+                            continue;
+                        }
+                        //ロシアンルーレット(CastRayと同じ)
+                        if (depth >= settings.rouletteDepth)
+                        {
+                            float p = std::min(1.0f, path.throughput.Max());
+                            if (path.sampler.Get1D() >= p)
+                            {
+                                STATS_ADD(rouletteTerminations, 1);
+                                continue;
+                            }
+                            path.throughput = path.throughput * (1 / p);
+                        }
+                        const HitRecord &hit = hits[queue[k]];
+                        ShadowState shadow;
+                        if (SampleLight(path.ray, hit, path.sampler, shadow.light))
+                        {
+                            shadow.throughput = path.throughput;
+                            shadow.slot = path.slot;
+                            shadows.push_back(shadow);
+                        }
+                        path.ray = GetSecondRay(path.ray, hit, path.sampler);
+                        path.bsdfPdf = BSDFPdf(hit, path.ray);
+                        path.lastPoint = hit.point;
+                        next.push_back(path);
+                    }
+                }
+                //影の光線をまとめて判定し、遮られなかった光を足す
+                for (size_t n = 0; n < shadows.size(); n++)
+                {
+                    if (IsVisible(shadows[n].light))
+                    {
+                        results[shadows[n].slot] = results[shadows[n].slot] + shadows[n].light.radiance * shadows[n].throughput;
+                    }
+                }
+                //次の交差判定の前に、二次光線を始点のセルと方向でまとめる
+                if (settings.binRays)
+                {
+                    binner.Order((int)next.size(), [&next](int n) -> const Ray & { return next[n].ray; }, order);
+                    paths.clear();
+                    for (size_t n = 0; n < order.size(); n++)
+                    {
+                        paths.push_back(next[order[n]]);
+                    }
+                    continue;
+                }
+                paths.swap(next);
+            }
+            //通常の描画と同じ順にフレームバッファへ足し込む
+            for (int slot = begin; slot < end; slot++)
+            {
+                int pixel = slot / sampleCount;
+                frame.Add(tile.x0 + pixel % width, tile.y0 + pixel / width, results[slot - begin]);
+            }
+        }
+    }
+    //ピクセル(x,y)のn番目のサンプルの色を求める
+    Color RenderSample(int x, int y, int n, Sampler &sampler) const
+    {
+        //このサンプル用の乱数列を開始する
+        sampler.StartPixelSample(x, y, n);
+        //カメラからの光線を取得する
+        Ray cameraRay = camera.GetScreenRay(x, y, sampler);
+        //光線を飛ばして色を取得する(ほかのAOVは--aovで指定する)
+        return CastRay(cameraRay, sampler);
+    }
+    //世界の背景を取得
+    Color BackImage(Ray ray) const
+    {
+        ray.direction.Norm();
+        if (environment != NULL)
+        {
+            return environment->GetColor(ray.direction);
+        }
+        //環境光がなければ、方位角と高さを色にした目印の背景にする
+        float u = atan2f((float)ray.direction.z, (float)ray.direction.x) * (float)(1 / (2 * PI));
+        u -= floorf(u);
+        float v = ((float)ray.direction.y + 1) / 2;
+        return Color::FromByte((int)((255 - 1) * u), (int)((255 - 1) * v), (int)((255 - 1) * v));
+    }
+    //反射方向で背景に抜けた光(lastPointで環境光をサンプリングした場合とMISで重み付けする)
+    Color Background(const Ray &ray, float bsdfPdf) const
+    {
+        Color color = BackImage(ray);
+        if (bsdfPdf <= 0 || environment == NULL)
+        {
+            return color;
+        }
+        Vector3 direction = ray.direction;
+        direction.Norm();
+        return color * PowerHeuristic(bsdfPdf, environment->Pdf(direction) / LightCount());
+    }
+    //最も近い交点を求める
+    bool Intersect(const Ray &ray, HitRecord &hit) const
+    {
+#if defined(RENDER_STATS)
+        ThreadStats &stats = RenderStats::Local();
+        stats.raysPerDepth[std::min(ray.reflectCount, RENDER_STATS_DEPTH - 1)]++;
+        bool isHit = scene->Intersect(ray, hit, 1000, &stats.nodeVisits);
+        if (isHit)
+        {
+            stats.hitsPerType[scene->materials[hit.materialId].type]++;
+        }
+        return isHit;
+#else
+        return scene->Intersect(ray, hit);
+#endif
+    }
+    //交点で反射・屈折したレイを取得する
+    Ray GetSecondRay(const Ray &ray, const HitRecord &hit, Sampler &sampler) const
+    {
+        //入射ベクトルを求める
+        Vector3 I = -ray.direction;
+        I.Norm();
+        //反射位置に関して少し表面より外側に位置をずらす(エラー回避)
+        Vector3 P = hit.point + hit.normal * 0.0001;
+        //素材の違いを考慮したレイを取得する
+        Ray secondRay = scene->materials[hit.materialId].GetRay(P, I, hit.normal, !hit.frontFace, sampler);
+        //反射回数を+1する
+        secondRay.reflectCount = ray.reflectCount + 1;
+        return secondRay;
+    }
+    //光線を飛ばしてAOVの色を取得する
+    Color GetAOV(AOV aov, const Ray &inputRay, Sampler &sampler) const
+    {
+        HitRecord hit;
+        if (!Intersect(inputRay, hit))
+        {
+            hit.materialId = -1;
+        }
+        return ShadeAOV(aov, inputRay, hit, sampler);
+    }
+    //求め済みの交点hitからAOVの色を求める(hit.materialIdが負なら外れ)
+    Color ShadeAOV(AOV aov, const Ray &inputRay, const HitRecord &hit, Sampler &sampler) const
+    {
+        bool isHit = hit.materialId >= 0;
+        switch (aov)
+        {
+        case AOV_BEAUTY:
+            return CastRay(inputRay, sampler, &hit);
+        case AOV_NORMAL:
+            if (isHit)
+            {
+                return hit.normal.ToColor(); //法線ベクトルを求める
+            }
+            //反射しない場合は背景を写す
+            return BackImage(inputRay);
+        case AOV_DEPTH:
+            if (isHit)
+            {
+                //基準を６として算出(距離4以上は背景と同じ0にそろえ、背景より手前に見えないようにする)
+                float depth = std::max(0.0f, std::min(1.0f, (float)((-1.0 / 4.0) * hit.t + 1.0)));
+                return Color(depth, depth, depth); //ぶつかると真っ白
+            }
+            //反射しない場合は最も遠い0にする
+            return Color(0, 0, 0);
+        case AOV_DISPARITY:
+            if (isHit)
+            {
+                float disparity = (float)(1 / hit.t);
+                return Color(disparity, disparity, disparity);
+            }
+            return Color(0, 0, 0);
+        case AOV_ALBEDO:
+            if (isHit)
+            {
+                return scene->materials[hit.materialId].color; //物体の色を求める
+            }
+            //反射しない場合は背景を写す
+            return BackImage(inputRay);
+        case AOV_OUTLINE:
+            if (isHit)
+            {
+                //入射ベクトルを求める
+                Vector3 I = -inputRay.direction;
+                I.Norm();
+                //メッシュは半径1の球体と同じ太さにする
+                Real radius = hit.objectId >= 0 ? scene->objects[hit.objectId].radius : 1;
+                if (I.Dot(hit.normal) < 0.1 / sqrt(sqrt(radius)))
+                {
+                    return Color(1, 1, 1);
+                }
+            }
+            //反射しない場合は背景を写す
+            return Color(0, 0, 0);
+        case AOV_SECOND:
+            //すでに規定回数反射している場合は打ち切り
+            if (inputRay.reflectCount >= settings.maxDepth)
+            {
+                Color black(0, 0, 0);
+                return black;
+            }
+            //交差がある場合は再帰的に反射させる
+            if (isHit)
+            {
+                //反射した物体のマテリアルを取得
+                const Material &material = scene->materials[hit.materialId];
+                //反射したレイを取得
+                Ray secondRay = GetSecondRay(inputRay, hit, sampler);
+                //再帰的に次のレイを飛ばす
+                if (inputRay.reflectCount == 0)
+                {
+                    return CastRay(secondRay, sampler) - (material.color * material.albedo);
+                }
+                else
+                {
+                    return CastRay(secondRay, sampler) * material.albedo * material.color;
+                }
+            }
+            //反射しない場合は背景を写す
+            return BackImage(inputRay);
+        default:
+            return Color(0, 0, 0);
+        }
+    }
+    //光線を飛ばして色を取得する
+    //再帰せずに経路の重み(スループット)を掛け合わせながら反射を繰り返す
+    //拡散面では光る球体を直接サンプリングし(次イベント推定)、反射方向で光源に当たった場合とMISで重み付けして足す
+    //primaryがあれば最初の交差判定の代わりに使う(materialIdが負なら外れ)
+    Color CastRay(Ray ray, Sampler &sampler, const HitRecord *primary = NULL) const
+    {
+        //これまでの反射で掛かった重み(各成分0~1、ルーレット後は1を超えることもある)
+        Color throughput(1, 1, 1);
+        //これまでに集めた光
+        Color radiance(0, 0, 0);
+        //直前の反射の位置と、その方向を選んだ確率密度(0なら光源サンプリングと重み付けしない)
+        Vector3 lastPoint;
+        float bsdfPdf = 0;
+        for (int depth = ray.reflectCount;; depth++)
+        {
+            //すでに規定回数反射している場合は打ち切り
+            if (depth >= settings.maxDepth)
+            {
+                return radiance;
+            }
+            HitRecord hit;
+            bool isHit;
+            if (primary != NULL)
+            {
+                hit = *primary;
+                isHit = hit.materialId >= 0;
+                primary = NULL;
+            }
+            else
+            {
+                isHit = Intersect(ray, hit);
+            }
+            //反射しない場合は背景を写す
+            if (!isHit)
+            {
+                return radiance + Background(ray, bsdfPdf) * throughput;
+            }
+            //光る球体に当たった場合はMISの重みを掛けて足す
+            const Material &material = scene->materials[hit.materialId];
+            radiance = radiance + Emission(hit, lastPoint, bsdfPdf) * throughput;
+            //反射した物体のマテリアルの色と反射率を重みに掛ける
+            throughput = throughput * material.color * material.albedo;
+            if (throughput.Max() <= 0)
+            {
+                return radiance;
+            }
+            //ロシアンルーレット：重みが小さい経路は確率的に打ち切り、生き残った経路の重みを補正する
+            if (depth >= settings.rouletteDepth)
+            {
+                float p = std::min(1.0f, throughput.Max());
+                if (sampler.Get1D() >= p)
+                {
+                    STATS_ADD(rouletteTerminations, 1);
+                    return radiance;
+                }
+                throughput = throughput * (1 / p);
+            }
+            //拡散面では光源へ影の光線を飛ばす
+            LightSample light;
+            if (SampleLight(ray, hit, sampler, light) && IsVisible(light))
+            {
+                radiance = radiance + light.radiance * throughput;
+            }
+            //反射したレイで続ける
+            Ray nextRay = GetSecondRay(ray, hit, sampler);
+            bsdfPdf = BSDFPdf(hit, nextRay);
+            lastPoint = hit.point;
+            ray = nextRay;
+        }
+    }
+    //光源サンプリングで選ぶ光源の数(光る球体と環境光)
+    int LightCount() const
+    {
+        return (int)scene->lights.size() + (environment != NULL);
+    }
+    //拡散面の交点から光源を1つ選び、その方向を選ぶ
+    //  光る球体: 交点から球体を見込む円錐の中で一様に選ぶ(立体角サンプリング)
+    //  環境光: 明るい画素ほど選ばれやすいように選ぶ
+    //光源サンプリングを使わない場合や、光源が面の裏側になる方向を選んだ場合はfalse
+    //影の光線も1回の反射に数え、反射方向で光源に当たる経路と同じ長さまでに揃える(MISの重みの和が1になるように)
+    bool SampleLight(const Ray &ray, const HitRecord &hit, Sampler &sampler, LightSample &sample) const
+    {
+        const std::vector<int> &lights = scene->lights;
+        int lightCount = LightCount();
+        if (!settings.lightSampling || lightCount == 0 || scene->materials[hit.materialId].type != DIFFUSE || ray.reflectCount + 1 >= settings.maxDepth)
+        {
+            return false;
+        }
+        int lightIndex = std::min((int)(sampler.Get1D() * lightCount), lightCount - 1);
+        float u = (float)sampler.Get1D(), v = (float)sampler.Get1D();
+        if (lightIndex == (int)lights.size())
+        {
+            return SampleEnvironment(ray, hit, u, v, sampler, sample);
+        }
+        const Sphere &light = scene->objects[lights[lightIndex]];
+        //円錐の軸(光源の中心方向)と、円錐の立体角を決める1-cos(半頂角)
+        Vector3 axis = light.center - hit.point;
+        Real distance2 = axis.Dot(axis);
+        Real sin2Max = light.radius * light.radius / distance2;
+        if (sin2Max >= 1)
+        {
+            return false;
+        }
+        Real oneMinusCosMax = sin2Max / (1 + sqrt(1 - sin2Max)); //遠くの小さな光源でも桁落ちしないように変形
+        axis = axis * (1 / sqrt(distance2));
+        //円錐の中の方向
+        Real cosTheta = 1 - u * oneMinusCosMax;
+        Real sinTheta = sqrt(std::max((Real)0, 1 - cosTheta * cosTheta));
+        Real phi = 2 * PI * v;
+        Vector3 tangent = (fabs(axis.x) > 0.1 ? Vector3(0, 1, 0) : Vector3(1, 0, 0)).Cross(axis);
+        tangent.Norm();
+        Vector3 bitangent = axis.Cross(tangent);
+        Vector3 direction = tangent * (sinTheta * cos(phi)) + bitangent * (sinTheta * sin(phi)) + axis * cosTheta;
+        float cosine = (float)hit.normal.Dot(direction);
+        if (cosine <= 0)
+        {
+            return false;
+        }
+        //光源を選んだ確率も含めた立体角あたりの確率密度と、同じ方向を反射で選ぶ確率密度(cos/π)
+        float lightPdf = (float)(1 / (2 * PI * oneMinusCosMax * lightCount));
+        float reflectPdf = cosine / PI;
+        const Material &material = scene->materials[light.materialId];
+        //拡散面のBRDF(反射率/π、反射率はスループットに掛け済み)×cos÷確率密度×MISの重み
+        sample.radiance = material.emission * (cosine / PI / lightPdf * PowerHeuristic(lightPdf, reflectPdf));
+        sample.shadowRay = Ray(hit.point + hit.normal * 0.0001, direction);
+        sample.shadowRay.reflectCount = ray.reflectCount + 1;
+        sample.objectId = lights[lightIndex];
+        return true;
+    }
+    //SampleLightで環境光を選んだ場合(u, vはSampleLightで引いた乱数)
+    bool SampleEnvironment(const Ray &ray, const HitRecord &hit, float u, float v, Sampler &sampler, LightSample &sample) const
+    {
+        float r2 = (float)sampler.Get1D(), r3 = (float)sampler.Get1D();
+        Vector3 direction;
+        float pdf;
+        if (!environment->Sample(u, v, r2, r3, direction, pdf))
+        {
+            return false;
+        }
+        float cosine = (float)hit.normal.Dot(direction);
+        if (cosine <= 0)
+        {
+            return false;
+        }
+        float lightPdf = pdf / LightCount();
+        float reflectPdf = cosine / PI;
+        sample.radiance = environment->GetColor(direction) * (cosine / PI / lightPdf * PowerHeuristic(lightPdf, reflectPdf));
+        sample.shadowRay = Ray(hit.point + hit.normal * 0.0001, direction);
+        sample.shadowRay.reflectCount = ray.reflectCount + 1;
+        sample.objectId = -1;
+        return true;
+    }
+    //影の光線が狙った光源まで遮られずに届くか？(環境光は何にも当たらなければ届く)
+    bool IsVisible(const LightSample &sample) const
+    {
+        HitRecord hit;
+        if (sample.objectId < 0)
+        {
+            return !Intersect(sample.shadowRay, hit);
+        }
+        return Intersect(sample.shadowRay, hit) && hit.objectId == sample.objectId && hit.frontFace;
+    }
+    //点pointから光源サンプリングでobjectIdの球体の方向を選ぶ確率密度(光源を選ぶ確率も含む)
+    float LightPdf(const Vector3 &point, int objectId) const
+    {
+        const Sphere &light = scene->objects[objectId];
+        Vector3 axis = light.center - point;
+        Real sin2Max = light.radius * light.radius / axis.Dot(axis);
+        if (sin2Max >= 1)
+        {
+            return 0;
+        }
+        Real oneMinusCosMax = sin2Max / (1 + sqrt(1 - sin2Max));
+        return (float)(1 / (2 * PI * oneMinusCosMax * LightCount()));
+    }
+    //交点hitで反射したnextRayの方向を選んだ確率密度(光源サンプリングと重み付けしない場合は0)
+    float BSDFPdf(const HitRecord &hit, const Ray &nextRay) const
+    {
+        if (!settings.lightSampling || LightCount() == 0 || scene->materials[hit.materialId].type != DIFFUSE)
+        {
+            return 0;
+        }
+        return (float)std::max((Real)0, hit.normal.Dot(nextRay.direction) / nextRay.direction.Length()) / PI;
+    }
+    //反射方向で当たった光る球体の光(lastPointで光源サンプリングした場合とMISで重み付けする)
+    Color Emission(const HitRecord &hit, const Vector3 &lastPoint, float bsdfPdf) const
+    {
+        const Material &material = scene->materials[hit.materialId];
+        if (!material.IsEmissive() || !hit.frontFace)
+        {
+            return Color(0, 0, 0);
+        }
+        //光る三角形は光源サンプリングの対象外なので重みを掛けない
+        if (bsdfPdf <= 0 || hit.objectId < 0)
+        {
+            return material.emission;
+        }
+        return material.emission * PowerHeuristic(bsdfPdf, LightPdf(lastPoint, hit.objectId));
+    }
+    //MISのパワーヒューリスティック(β=2)
+    static float PowerHeuristic(float pdf, float otherPdf)
+    {
+        return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+    }
+};
+
+//シーンファイルのキャッシュ(読み込んだWorldを複製して使う)
+FileCache<World> sceneCache;
+
+//描画オプションを解釈してworldに設定する(解釈できない引数があればfalse)
+//--sceneは他の引数より先に読み込み、他の引数でその設定を上書きできるようにする
+bool ParseRenderOptions(const std::vector<std::string> &args, World &world)
+{
+    for (size_t n = 0; n + 1 < args.size(); n++)
+    {
+        if (args[n] == "--scene")
+        {
+            std::shared_ptr<const World> loaded = sceneCache.Get(args[n + 1], [](World &w, const std::string &path) { return w.LoadScene(path.c_str()); });
+            if (loaded == NULL)
+            {
+                return false;
+            }
+            world = *loaded;
+        }
+    }
+    for (size_t n = 0; n < args.size(); n++)
+    {
+        const std::string &arg = args[n];
+        bool hasValue = n + 1 < args.size();
+        if (arg == "--scene" && hasValue)
+        {
+            n++;
+        }
+        else if (arg == "--camera" && n + 7 < args.size())
+        {
+            Vector3 eye(atof(args[n + 1].c_str()), atof(args[n + 2].c_str()), atof(args[n + 3].c_str()));
+            Vector3 lookAt(atof(args[n + 4].c_str()), atof(args[n + 5].c_str()), atof(args[n + 6].c_str()));
+            world.camera.Set(eye, lookAt, atof(args[n + 7].c_str()), world.settings.width, world.settings.height);
+            n += 7;
+        }
+        else if (arg == "--size" && n + 2 < args.size())
+        {
+            world.settings.width = atoi(args[++n].c_str());
+            world.settings.height = atoi(args[++n].c_str());
+        }
+        else if (arg == "--threads" && hasValue)
+        {
+            world.settings.threadCount = atoi(args[++n].c_str());
+        }
+        else if (arg == "--depth" && hasValue)
+        {
+            world.settings.maxDepth = atoi(args[++n].c_str());
+        }
+        else if (arg == "--output" && hasValue)
+        {
+            world.settings.outputPath = args[++n];
+            world.settings.outputFormat = ImageFormatFromPath(world.settings.outputPath);
+        }
+        else if (arg == "--back" && hasValue)
+        {
+            world.backgroundPath = args[++n];
+            world.environment = NULL;
+        }
+        else if (arg == "--ascii")
+        {
+            world.settings.outputFormat = FORMAT_P3;
+        }
+        else if (arg == "--stream")
+        {
+            world.settings.streamOutput = true;
+        }
+        else if (arg == "--spp" && hasValue)
+        {
+            world.settings.samplesPerPixel = atoi(args[++n].c_str());
+        }
+        else if (arg == "--progressive")
+        {
+            world.settings.progressive = true;
+        }
+        else if (arg == "--snapshot-passes" && hasValue)
+        {
+            world.settings.snapshotPasses = atoi(args[++n].c_str());
+        }
+        else if (arg == "--snapshot-seconds" && hasValue)
+        {
+            world.settings.snapshotSeconds = atof(args[++n].c_str());
+        }
+        else if (arg == "--adaptive")
+        {
+            world.settings.adaptive = true;
+        }
+        else if (arg == "--threshold" && hasValue)
+        {
+            world.settings.adaptiveThreshold = atof(args[++n].c_str());
+        }
+        else if (arg == "--min-spp" && hasValue)
+        {
+            world.settings.adaptiveMinSamples = atoi(args[++n].c_str());
+        }
+        else if (arg == "--morton")
+        {
+            world.settings.frameLayout = LAYOUT_MORTON;
+        }
+        else if (arg == "--wavefront")
+        {
+            world.settings.wavefront = true;
+        }
+        else if (arg == "--bin-rays")
+        {
+            world.settings.wavefront = true;
+            world.settings.binRays = true;
+        }
+        else if (arg == "--no-light-sampling")
+        {
+            world.settings.lightSampling = false;
+        }
+        else if (arg == "--denoise")
+        {
+            world.settings.denoise = true;
+        }
+        else if (arg == "--aov" && n + 2 < args.size())
+        {
+            AOV aov = AOVFromName(args[++n]);
+            if (aov == AOV_COUNT)
+            {
+                fprintf(stderr, "unknown AOV %s\n", args[n].c_str());
+                return false;
+            }
+            world.settings.aovPaths[aov] = args[++n];
+        }
+        else
+        {
+            fprintf(stderr, "invalid option %s\n", arg.c_str());
+            return false;
+        }
+    }
+    if (world.settings.width <= 0 || world.settings.height <= 0)
+    {
+        fprintf(stderr, "invalid size %dx%d\n", world.settings.width, world.settings.height);
+        return false;
+    }
+    //AOVとノイズ除去はまとめて1回で描画するので、描画方法を変える指定とは組み合わせられない
+    if (world.HasAOVs() || world.settings.denoise)
+    {
+        const char *mode = world.settings.progressive ? "--progressive" : world.settings.adaptive ? "--adaptive" : world.settings.wavefront ? "--wavefront" : NULL;
+        if (mode != NULL)
+        {
+            fprintf(stderr, "%s cannot be combined with --aov or --denoise\n", mode);
+            return false;
+        }
+    }
+    //サンプル数0(無制限)は段階的描画だけで使え、それ以外では平均が0除算になる
+    if (world.settings.samplesPerPixel < 1 && !(world.settings.progressive && world.settings.samplesPerPixel == 0))
+    {
+        fprintf(stderr, "invalid spp %d (must be at least 1, or 0 with --progressive)\n", world.settings.samplesPerPixel);
+        return false;
+    }
+    return true;
+}
+
+//バッチ描画サーバ
+//ジョブはコマンドラインと同じ描画オプションの並び(例: --scene a.txt --camera 0 0 5 0 0 -1 45 --spp 64 --output a.ppm)で、
+//標準入力から1行1ジョブで読むか、スプールディレクトリに置かれた*.jobファイルを1ファイル1ジョブで読む
+//(スプールのジョブは処理中に*.job.work、終了後に*.job.done・*.job.failed・途中で止めた*.job.interruptedへ名前を変える)
+//シーンと背景はキャッシュしてジョブ間で共有し、複数のジョブを並行して描画する
+class BatchServer
+{
+public:
+    //spoolDirが空なら標準入力から読む。jobSlotsは同時に描画するジョブ数
+    BatchServer(const std::string &_spoolDir, int _jobSlots) : spoolDir(_spoolDir), jobSlots(_jobSlots), done(0), failed(0), interrupted(0)
+    {
+        //コアを同時に描画するジョブで分け合う
+        threadsPerJob = std::max(1, RenderThreadCount() / jobSlots);
+    }
+
+    //ジョブが尽きる(スプールではCtrl-Cで止める)まで描画し、失敗したか途中で止めたジョブがあればfalse
+    bool Run()
+    {
+        void (*previous)(int) = signal(SIGINT, OnInterrupt);
+        timer.Reset();
+        std::vector<std::thread> workers;
+        for (int n = 0; n < jobSlots; n++)
+        {
+            workers.push_back(std::thread([this]() { Work(); }));
+        }
+        for (size_t n = 0; n < workers.size(); n++)
+        {
+            workers[n].join();
+        }
+        signal(SIGINT, previous);
+        fprintf(stderr, "batch: %d jobs done, %d failed, %d interrupted in %.1f s (%.0f jobs/hour)\n", (int)done, (int)failed, (int)interrupted, timer.Seconds(), JobsPerHour());
+        return failed == 0 && interrupted == 0;
     }
 
 private:
-    //世界の背景を取得
-    Color BackImage(Ray ray)
+    std::string spoolDir;
+    int jobSlots, threadsPerJob;
+    World defaultWorld; //--sceneの無いジョブが使う組み込みのシーン
+    std::deque<std::string> pending; //スプールで見つけた未処理のジョブファイル
+    std::mutex lock;      //スプールと結果の出力
+    std::mutex inputLock; //標準入力の読み込み
+    std::atomic<int> done, failed, interrupted;
+    Timer timer;
+
+    //各スレッドでジョブを取り出しては描画する
+    void Work()
     {
-        ray.direction.Norm();
-        float x = (float)ray.direction.x;
-        float y = (float)ray.direction.y;
-        float z = (float)ray.direction.z;
-        //円柱座標変換
-        float theta; //(-Pi/2)~(Pi/2)
-        if ((x >= 0) && (z >= 0))
+        std::string job, spoolFile;
+        while (NextJob(job, spoolFile))
         {
-            //第1象限
-            theta = (float)atan(z / x);
+            Timer jobTimer;
+            std::vector<std::string> args;
+            SplitArgs(job, args);
+            World world = defaultWorld;
+            world.settings.threadCount = 0;
+            bool ok = ParseRenderOptions(args, world);
+            if (ok)
+            {
+                if (world.settings.threadCount <= 0)
+                {
+                    world.settings.threadCount = threadsPerJob;
+                }
+                ok = world.GetImage();
+            }
+            //Ctrl-Cで途中まで描いた段階的描画は、終わったことにしない
+            const char *status = !ok ? "failed" : world.interrupted ? "interrupted" : "done";
+            (!ok ? failed : world.interrupted ? interrupted : done)++;
+            if (!spoolFile.empty())
+            {
+                rename((spoolFile + ".work").c_str(), (spoolFile + "." + status).c_str());
+            }
+            //結果は1ジョブ1行で標準出力に、集計は標準エラーに出す
+            std::lock_guard<std::mutex> guard(lock);
+            printf("%s %s %.2f\n", status, ok ? world.settings.outputPath.c_str() : (spoolFile.empty() ? job.c_str() : spoolFile.c_str()), jobTimer.Seconds());
+            fflush(stdout);
+            fprintf(stderr, "batch: %d done, %d failed, %d interrupted, %.0f jobs/hour\n", (int)done, (int)failed, (int)interrupted, JobsPerHour());
         }
-        if ((x < 0) && (z >= 0))
+    }
+    double JobsPerHour() const { return (done + failed + interrupted) * 3600.0 / std::max(timer.Seconds(), 1e-9); }
+    //次のジョブを取り出す(これ以上無ければfalse)
+    bool NextJob(std::string &job, std::string &spoolFile)
+    {
+        if (spoolDir.empty())
         {
-            //第2象限
-            theta = (float)atan(z / x) + PI;
+            //入力を待つ間も他のスレッドが結果を報告できるよう、標準入力は専用のロックで読む
+            std::lock_guard<std::mutex> guard(inputLock);
+            return NextLine(job);
         }
-        if ((x < 0) && (z < 0))
+        std::unique_lock<std::mutex> guard(lock);
+        while (!renderInterrupted)
         {
-            //第3象限
-            theta = (float)atan(z / x) + PI;
+            if (pending.empty())
+            {
+                ScanSpool();
+            }
+            if (pending.empty())
+            {
+                //新しいジョブが置かれるのを待つ(待つ間は他のスレッドが結果を報告できるようロックを外す)
+                guard.unlock();
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                guard.lock();
+                continue;
+            }
+            spoolFile = spoolDir + "/" + pending.front();
+            pending.pop_front();
+            //名前を変えられたら自分のもの(他のサーバが先に取っていれば次へ)
+            std::string work = spoolFile + ".work";
+            if (rename(spoolFile.c_str(), work.c_str()) != 0)
+            {
+                continue;
+            }
+            MappedFile file;
+            job = file.Open(work.c_str()) ? std::string((const char *)file.data, file.size) : std::string();
+            return true;
         }
-        if ((x >= 0) && (z < 0))
+        return false;
+    }
+    //標準入力から空行とコメント以外の次の行を読む
+    bool NextLine(std::string &job)
+    {
+        char buff[4096];
+        while (!renderInterrupted && fgets(buff, sizeof(buff), stdin) != NULL)
         {
-            //第4象限
-            theta = (float)atan(z / x) + 2 * PI;
+            job = buff;
+            size_t start = job.find_first_not_of(" \t\r\n");
+            if (start != std::string::npos && job[start] != '#')
+            {
+                job = job.substr(start, job.find_last_not_of(" \t\r\n") + 1 - start);
+                return true;
+            }
         }
-        float height = sqrt(1 - (x * x + z * z));
-        if (y < 0)
+        return false;
+    }
+    //スプールディレクトリの*.jobを名前順に未処理のリストへ加える
+    void ScanSpool()
+    {
+        DIR *dir = opendir(spoolDir.c_str());
+        if (dir == NULL)
         {
-            height = -height;
+            fprintf(stderr, "cannot open %s\n", spoolDir.c_str());
+            renderInterrupted = 1;
+            return;
         }
-        //printf("%f\n", theta);
-        //光線をスクリーンに変換する
-        int u, v;
-        u = (int)((255 - 1) * (theta / (2.0 * PI)));
-        v = (int)((255 - 1) * ((height + 1.0) / 2.0));
-        //printf("%d\n", u);
-        //画像の色を取得する
-        //return backImage.GetColor(u, v);
-        return Color(u, v, v);
-        //青空の色を出力する
-        //return Color(150, 200, 255);
-    }
-    //光線を飛ばして色を取得する
-    Color GetNormal(Ray inputRay)
-    { //一番近い交点を求める
-        double closestT = 1000;
-        int objectIndex;
-        bool isHit = false;
-        //すべてのオブジェクトについて衝突を検索
-        for (int n = 0; n < 4; n++)
+        std::vector<std::string> names;
+        while (struct dirent *entry = readdir(dir))
         {
-            //交点が存在する場合
-            if (objects[n].IsHit(inputRay))
+            std::string name = entry->d_name;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".job") == 0)
             {
-                //交点がより近い場合は更新する
-                if (objects[n].solveT1 < closestT)
-                {
-                    closestT = objects[n].solveT1;
-                    objectIndex = n;
-                    isHit = true;
-                }
+                names.push_back(name);
             }
         }
-        //交差がある場合は再帰的に反射させる
-        if (isHit)
+        closedir(dir);
+        std::sort(names.begin(), names.end());
+        pending.insert(pending.end(), names.begin(), names.end());
+    }
+    //空白で区切って引数の並びにする
+    static void SplitArgs(const std::string &line, std::vector<std::string> &args)
+    {
+        size_t pos = 0;
+        while ((pos = line.find_first_not_of(" \t\r\n", pos)) != std::string::npos)
         {
-            //反射した物体のマテリアルを取得
-            Material material = objects[objectIndex].material;
-            //反射したレイを取得
-            Ray secondRay = objects[objectIndex].GetRay(inputRay);
-            //反射回数を+1する
-            secondRay.reflectCount = inputRay.reflectCount + 1;
-            //再帰的に次のレイを飛ばす
-            return objects[objectIndex].GetNormalRay(inputRay); //法線ベクトルを求める
-            //return CastRay(secondRay) * material.albedo * material.color;
-            //return Color(255, 255, 255); //ぶつかると真っ白
+            size_t end = line.find_first_of(" \t\r\n", pos);
+            if (end == std::string::npos)
+            {
+                end = line.size();
+            }
+            args.push_back(line.substr(pos, end - pos));
+            pos = end;
         }
-        //反射しない場合は背景を写す
-        return BackImage(inputRay);
     }
-    //光線を飛ばして色を取得する
-    Color GetDepth(Ray inputRay)
+};
+
+//BVHのベンチマーク：球体数を変えて1本あたりの交差判定時間を測る(SIMDの葉と倍精度の葉を比較)
+void BenchBVH()
+{
+    const int rayCount = 200000;
+    printf("%10s %12s %14s %14s %14s\n", "spheres", "build[ms]", "bvh[ns/ray]", "scalar[ns/ray]", "linear[ns/ray]");
+    for (int sphereCount = 16; sphereCount <= (1 << 20); sphereCount *= 4)
     {
-        //一番近い交点を求める
-        double closestT = 1000;
-        int objectIndex;
-        bool isHit = false;
-        //すべてのオブジェクトについて衝突を検索
-        for (int n = 0; n < 4; n++)
+        //単位立方体に一定の充填率で球体を配置する
+        Random random(sphereCount);
+        Scene scene;
+        int material = scene.AddMaterial(Color(1, 1, 1), 0.5, DIFFUSE);
+        float radius = 0.3 / cbrt((double)sphereCount);
+        for (int n = 0; n < sphereCount; n++)
+        {
+            scene.AddSphere(Vector3(random.Next(), random.Next(), random.Next()), radius, material);
+        }
+        Timer timer;
+        scene.Build();
+        double buildTime = timer.Seconds();
+        //立方体の外側から内部へ向かう光線を用意する
+        std::vector<Ray> rays;
+        for (int n = 0; n < rayCount; n++)
         {
-            //交点が存在する場合
-            if (objects[n].IsHit(inputRay))
+            Vector3 origin = Vector3(random.Next(), random.Next(), random.Next()).Norm() * 3 + Vector3(0.5, 0.5, 0.5);
+            Vector3 target(random.Next(), random.Next(), random.Next());
+            rays.push_back(Ray(origin, (target - origin).Norm()));
+        }
+        int hitCount = 0;
+        timer.Reset();
+        for (int n = 0; n < rayCount; n++)
+        {
+            HitRecord hit;
+            hitCount += scene.Intersect(rays[n], hit);
+        }
+        double bvhTime = timer.Seconds();
+        //葉を1つずつ判定する場合
+        timer.Reset();
+        for (int n = 0; n < rayCount; n++)
+        {
+            HitRecord hit;
+            hitCount += scene.IntersectScalar(rays[n], hit);
+        }
+        double scalarTime = timer.Seconds();
+        //比較用の線形探索(大きなシーンでは時間がかかるので省略)
+        double linearTime = 0;
+        int linearRays = 0;
+        if (sphereCount <= 4096)
+        {
+            linearRays = rayCount / 10;
+            timer.Reset();
+            for (int n = 0; n < linearRays; n++)
             {
-                //交点がより近い場合は更新する
-                if (objects[n].solveT1 < closestT)
+                HitRecord hit;
+                double closestT = 1000;
+                for (int m = 0; m < sphereCount; m++)
                 {
-                    closestT = objects[n].solveT1;
-                    objectIndex = n;
-                    isHit = true;
+                    if (scene.objects[m].IsHit(rays[n], closestT, hit))
+                        closestT = hit.t;
                 }
+                hitCount += closestT < 1000;
             }
+            linearTime = timer.Seconds();
         }
-        //交差がある場合は再帰的に反射させる
-        if (isHit)
+        printf("%10d %12.2f %14.1f %14.1f ", sphereCount, buildTime * 1e3, bvhTime * 1e9 / rayCount, scalarTime * 1e9 / rayCount);
+        if (linearRays > 0)
+            printf("%14.1f\n", linearTime * 1e9 / linearRays);
+        else
+            printf("%14s\n", "-");
+        fprintf(stderr, "(hits %d)\n", hitCount);
+    }
+}
+
+//ハードウェア性能カウンタ(perf_event_openが使えない環境ではValue()が-1を返す)
+class PerfCounter
+{
+public:
+    //type/configはperf_event_attrと同じ(例: PERF_TYPE_HW_CACHE)
+    PerfCounter(uint32_t type, uint64_t config) : fd(-1)
+    {
+#if defined(__linux__)
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    ~PerfCounter()
+    {
+        if (fd >= 0)
         {
-            //解を取得
-            double solve = objects[objectIndex].solveT1;
-            //基準を６として算出
-            int depthGross = (int)(((-1.0 / 4.0) * solve + 1.0) * 255);
-            return Color(depthGross, depthGross, depthGross); //ぶつかると真っ白
+            close(fd);
         }
-        //反射しない場合は背景を写す
-        return Color(0, 0, 0);
     }
-    //光線を飛ばして色を取得する
-    Color GetColor(Ray inputRay)
+    void Start()
     {
-        //一番近い交点を求める
-        double closestT = 1000;
-        int objectIndex;
-        bool isHit = false;
-        //すべてのオブジェクトについて衝突を検索
-        for (int n = 0; n < 4; n++)
+#if defined(__linux__)
+        if (fd >= 0)
         {
-            //交点が存在する場合
-            if (objects[n].IsHit(inputRay))
-            {
-                //交点がより近い場合は更新する
-                if (objects[n].solveT1 < closestT)
-                {
-                    closestT = objects[n].solveT1;
-                    objectIndex = n;
-                    isHit = true;
-                }
-            }
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
         }
-        //交差がある場合は再帰的に反射させる
-        if (isHit)
+#endif
+    }
+    void Stop()
+    {
+#if defined(__linux__)
+        if (fd >= 0)
         {
-            //反射した物体のマテリアルを取得
-            Material material = objects[objectIndex].material;
-            //反射したレイを取得
-            Ray secondRay = objects[objectIndex].GetRay(inputRay);
-            //反射回数を+1する
-            secondRay.reflectCount = inputRay.reflectCount + 1;
-            //再帰的に次のレイを飛ばす
-            return material.color; //法線ベクトルを求める
-            //return CastRay(secondRay) * material.albedo * material.color;
-            //return Color(255, 255, 255); //ぶつかると真っ白
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
         }
-        //反射しない場合は背景を写す
-        return BackImage(inputRay);
+#endif
     }
-    //光線を飛ばして色を取得する
-    Color GetOutline(Ray inputRay)
+    long long Value() const
     {
-        //一番近い交点を求める
-        double closestT = 1000;
-        int objectIndex;
-        bool isHit = false;
-        //すべてのオブジェクトについて衝突を検索
-        for (int n = 0; n < 4; n++)
+        long long value;
+        if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+        {
+            return -1;
+        }
+        return value;
+    }
+#if defined(__linux__)
+    //キャッシュの読み込みミスを数えるカウンタ
+    static PerfCounter CacheMiss(uint64_t cache)
+    {
+        return PerfCounter(PERF_TYPE_HW_CACHE, cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    }
+#endif
+    PerfCounter(PerfCounter &&other) : fd(other.fd) { other.fd = -1; }
+    PerfCounter(const PerfCounter &) = delete;
+    PerfCounter &operator=(const PerfCounter &) = delete;
+
+private:
+    int fd;
+};
+
+//二次光線の並べ替えのベンチマーク：カメラから見た球体の集まりで拡散反射した光線を、
+//生成順のままと始点・方向で並べ替えた後とで交差判定し、1本あたりの時間・辿ったノード数・キャッシュミスを比べる
+void BenchBinning()
+{
+    const int width = 512, height = 512;
+#if defined(__linux__)
+    PerfCounter l1Miss = PerfCounter::CacheMiss(PERF_COUNT_HW_CACHE_L1D);
+    PerfCounter llMiss = PerfCounter::CacheMiss(PERF_COUNT_HW_CACHE_LL);
+#else
+    PerfCounter l1Miss(0, 0), llMiss(0, 0);
+#endif
+    printf("%10s %10s %12s %12s %14s %14s %12s\n", "spheres", "order", "ns/ray", "nodes/ray", "L1D-miss/ray", "LLC-miss/ray", "sort[ns/ray]");
+    for (int sphereCount = 4096; sphereCount <= (1 << 20); sphereCount *= 16)
+    {
+        //単位立方体に一定の充填率で球体を配置する(BenchBVHと同じ)
+        Random random(sphereCount);
+        Scene scene;
+        int material = scene.AddMaterial(Color(1, 1, 1), 0.5, DIFFUSE);
+        float radius = 0.3 / cbrt((double)sphereCount);
+        for (int n = 0; n < sphereCount; n++)
+        {
+            scene.AddSphere(Vector3(random.Next(), random.Next(), random.Next()), radius, material);
+        }
+        scene.Build();
+        //立方体を正面から見るカメラの光線をラスター順に飛ばし、当たった点で拡散反射させる
+        Camera camera;
+        camera.Set(Vector3(0.5, 0.5, 2.5), Vector3(0, 0, -1), 15, width, height);
+        Sampler sampler;
+        std::vector<Ray> rays;
+        for (int y = 0; y < height; y++)
         {
-            //交点が存在する場合
-            if (objects[n].IsHit(inputRay))
+            for (int x = 0; x < width; x++)
             {
-                //交点がより近い場合は更新する
-                if (objects[n].solveT1 < closestT)
+                sampler.StartPixelSample(x, y, 0);
+                Ray ray = camera.GetScreenRay(x, y, sampler);
+                HitRecord hit;
+                if (scene.Intersect(ray, hit))
                 {
-                    closestT = objects[n].solveT1;
-                    objectIndex = n;
-                    isHit = true;
+                    Vector3 I = -ray.direction;
+                    rays.push_back(scene.materials[hit.materialId].GetRay(hit.point + hit.normal * 0.0001, I.Norm(), hit.normal, !hit.frontFace, sampler));
                 }
             }
         }
-
-        //交差がある場合は再帰的に反射させる
-        if (isHit)
+        int rayCount = (int)rays.size();
+        //並べ替えた順の光線を用意する
+        Timer timer;
+        RayBinner binner(scene);
+        std::vector<int> order;
+        binner.Order(rayCount, [&rays](int n) -> const Ray & { return rays[n]; }, order);
+        double sortTime = timer.Seconds();
+        std::vector<Ray> binned;
+        binned.reserve(rayCount);
+        for (int n = 0; n < rayCount; n++)
+        {
+            binned.push_back(rays[order[n]]);
+        }
+        const char *names[] = {"generated", "binned"};
+        const std::vector<Ray> *orders[] = {&rays, &binned};
+        for (int k = 0; k < 2; k++)
         {
-            //反射位置Pを求める
-            Vector3 P = inputRay.origin + inputRay.direction * objects[objectIndex].solveT1; //P = A + tB
-            //入射ベクトルを求める
-            Vector3 I = -inputRay.direction.Norm();
-            //法線ベクトルを求める
-            Vector3 N = (P - objects[objectIndex].center).Norm();
-            if (I.Dot(N) < 0.1 / sqrt(sqrt(objects[objectIndex].radius)))
+            const std::vector<Ray> &list = *orders[k];
+            long visited = 0;
+            int hitCount = 0;
+            timer.Reset();
+            l1Miss.Start();
+            llMiss.Start();
+            for (int n = 0; n < rayCount; n++)
             {
-                return Color(255, 255, 255);
+                HitRecord hit;
+                hitCount += scene.Intersect(list[n], hit, 1000, &visited);
             }
+            l1Miss.Stop();
+            llMiss.Stop();
+            double seconds = timer.Seconds();
+            printf("%10d %10s %12.1f %12.1f ", sphereCount, names[k], seconds * 1e9 / rayCount, (double)visited / rayCount);
+            long long misses[] = {l1Miss.Value(), llMiss.Value()};
+            for (int m = 0; m < 2; m++)
+            {
+                if (misses[m] >= 0)
+                    printf("%14.2f ", (double)misses[m] / rayCount);
+                else
+                    printf("%14s ", "n/a");
+            }
+            if (k == 1)
+                printf("%12.1f\n", sortTime * 1e9 / rayCount);
+            else
+                printf("%12s\n", "-");
+            fprintf(stderr, "(%d rays, hits %d)\n", rayCount, hitCount);
         }
-        //反射しない場合は背景を写す
-        return Color(0, 0, 0);
     }
-    //光線を飛ばして色を取得する
-    Color GetSecond(Ray inputRay)
+}
+
+//frameをpathにformatで書き出した秒数(書き出せなければ負の値)
+double TimeOutput(const FrameBuffer &frame, ImageFormat format, const char *path, const ToneMapper &toneMapper)
+{
+    Timer timer;
+    ImageWriter writer;
+    if (!writer.Open(path, format, frame.width, frame.height))
+    {
+        return -1;
+    }
+    writer.WriteRows(frame, 0, frame.height, 1.0f, toneMapper);
+    if (!writer.Close())
+    {
+        fprintf(stderr, "cannot write %s\n", path);
+        return -1;
+    }
+    return timer.Seconds();
+}
+
+//画像書き出しのベンチマーク：4Kのフレームを各形式で書き出す時間を測る
+void BenchOutput()
+{
+    const int width = 3840, height = 2160;
+    const char *path = "./bench_output.tmp";
+    //それらしい値で埋める
+    FrameBuffer frame(width, height);
+    Random random(1);
+    for (size_t n = 0; n < frame.DataSize(); n++)
+    {
+        frame.Data()[n] = (float)random.Next();
+    }
+    ToneMapper toneMapper;
+    const char *names[] = {"P3", "P6", "PFM"};
+    printf("%8s %12s %12s\n", "format", "time[ms]", "size[MB]");
+    for (int format = FORMAT_P3; format <= FORMAT_PFM; format++)
     {
-        //すでに8回反射している場合は打ち切り
-        if (inputRay.reflectCount >= 4)
+        double seconds = TimeOutput(frame, (ImageFormat)format, path, toneMapper);
+        if (seconds < 0)
         {
-            Color black(0, 0, 0);
-            return black;
+            remove(path);
+            return;
         }
-        //一番近い交点を求める
-        double closestT = 1000;
-        int objectIndex;
-        bool isHit = false;
-        //すべてのオブジェクトについて衝突を検索
-        for (int n = 0; n < 4; n++)
+        FILE *fp = fopen(path, "rb");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "cannot open %s\n", path);
+            return;
+        }
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        fclose(fp);
+        printf("%8s %12.1f %12.1f\n", names[format], seconds * 1e3, size / 1e6);
+    }
+    remove(path);
+}
+
+//ノイズ除去のベンチマーク
+//サンプル数ごとに、除去にかかった時間(1メガピクセルあたり)と、多数のサンプルで描画した参照画像との平均二乗誤差の平方根(RMSE)を比べる
+void BenchDenoise(const char *scenePath, int referenceSamples)
+{
+    World world;
+    if (scenePath != NULL && !world.LoadScene(scenePath))
+    {
+        return;
+    }
+    world.LoadBackground();
+    int width = world.settings.width, height = world.settings.height;
+    //参照画像(beautyだけを描画する)
+    Timer timer;
+    std::vector<FrameBuffer> reference(AOV_COUNT);
+    reference[AOV_BEAUTY].Resize(width, height);
+    world.settings.samplesPerPixel = referenceSamples;
+    world.RenderAOVFrames(reference);
+    fprintf(stderr, "reference: %d spp, %.1fs\n", referenceSamples, timer.Seconds());
+    float referenceScale = 1.0f / referenceSamples;
+    //平均にした画素の差のRMSE
+    auto rmse = [&](const FrameBuffer &frame, float scale) {
+        double sum = 0;
+        for (int y = 0; y < height; y++)
         {
-            //交点が存在する場合
-            if (objects[n].IsHit(inputRay))
+            for (int x = 0; x < width; x++)
             {
-                //交点がより近い場合は更新する
-                if (objects[n].solveT1 < closestT)
+                Color a = frame.Get(x, y) * scale, b = reference[AOV_BEAUTY].Get(x, y) * referenceScale;
+                sum += (a.r - b.r) * (a.r - b.r) + (a.g - b.g) * (a.g - b.g) + (a.b - b.b) * (a.b - b.b);
+            }
+        }
+        return sqrt(sum / (3.0 * width * height));
+    };
+    printf("%6s %12s %12s %16s %14s\n", "spp", "render[s]", "rmse", "denoise[ms/MP]", "denoised rmse");
+    for (int samples = 1; samples <= 64 && samples < referenceSamples; samples *= 4)
+    {
+        std::vector<FrameBuffer> frames(AOV_COUNT);
+        const AOV used[] = {AOV_BEAUTY, AOV_NORMAL, AOV_DISPARITY, AOV_ALBEDO};
+        for (int n = 0; n < 4; n++)
+        {
+            frames[used[n]].Resize(width, height);
+        }
+        world.settings.samplesPerPixel = samples;
+        timer.Reset();
+        world.RenderAOVFrames(frames);
+        double renderSeconds = timer.Seconds();
+        //毎回描画したままの画像から除去する
+        FrameBuffer noisy = frames[AOV_BEAUTY];
+        double seconds = 1e30;
+        for (int run = 0; run < 3; run++)
+        {
+            frames[AOV_BEAUTY] = noisy;
+            timer.Reset();
+            world.Denoise(frames);
+            seconds = std::min(seconds, timer.Seconds());
+        }
+        printf("%6d %12.2f %12.5f %16.1f %14.5f\n", samples, renderSeconds, rmse(noisy, 1.0f / samples), seconds * 1e3 / (width * height / 1e6), rmse(frames[AOV_BEAUTY], 1.0f / samples));
+    }
+}
+
+//ベンチマークの最適化で計算が消されないよう結果を書き込む先
+volatile double benchSink;
+
+//kernel()を繰り返し実行し、最も速かった1回の秒数を返す(他の処理による揺らぎを除くため)
+template <class Kernel>
+double BestSeconds(Kernel kernel, int repeat = 5)
+{
+    double best = HUGE_VAL;
+    for (int n = 0; n < repeat; n++)
+    {
+        Timer timer;
+        kernel();
+        best = std::min(best, timer.Seconds());
+    }
+    return best;
+}
+
+//ベンチマーク結果を1行1件のJSONで出力する
+void ReportBench(const char *name, const char *unit, double value)
+{
+    printf("{\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.6g}\n", name, unit, value);
+    fflush(stdout);
+}
+
+//描画の主要な処理のベンチマーク(filterを名前に含むものだけ実行する)
+//結果は1行1件のJSONで出力するので、版ごとに保存して比較できる
+void BenchSuite(const std::string &filter)
+{
+    const int count = 4096;
+    Random random(1);
+    Sampler sampler;
+    sampler.StartPixelSample(0, 0, 0);
+    //ベクトル演算
+    std::vector<Vector3> a(count), b(count);
+    for (int n = 0; n < count; n++)
+    {
+        a[n] = Vector3(random.Next() - 0.5, random.Next() - 0.5, random.Next() - 0.5);
+        b[n] = Vector3(random.Next() - 0.5, random.Next() - 0.5, random.Next() - 0.5);
+    }
+    const int vectorLoops = 1000;
+    if (std::string("vector3_dot").find(filter) != std::string::npos)
+    {
+        double seconds = BestSeconds([&]() {
+            double sum = 0;
+            for (int loop = 0; loop < vectorLoops; loop++)
+                for (int n = 0; n < count; n++)
+                    sum += a[n].Dot(b[n]);
+            benchSink = sum;
+        });
+        ReportBench("vector3_dot", "ns/op", seconds * 1e9 / ((double)vectorLoops * count));
+    }
+    if (std::string("vector3_cross").find(filter) != std::string::npos)
+    {
+        double seconds = BestSeconds([&]() {
+            Vector3 sum;
+            for (int loop = 0; loop < vectorLoops; loop++)
+                for (int n = 0; n < count; n++)
+                    sum = sum + a[n].Cross(b[n]);
+            benchSink = sum.x + sum.y + sum.z;
+        });
+        ReportBench("vector3_cross", "ns/op", seconds * 1e9 / ((double)vectorLoops * count));
+    }
+    if (std::string("vector3_norm").find(filter) != std::string::npos)
+    {
+        double seconds = BestSeconds([&]() {
+            double sum = 0;
+            for (int loop = 0; loop < vectorLoops; loop++)
+                for (int n = 0; n < count; n++)
                 {
-                    closestT = objects[n].solveT1;
-                    objectIndex = n;
-                    isHit = true;
+                    Vector3 v = a[n] + b[n] * 0.5;
+                    sum += v.Norm().x;
+                }
+            benchSink = sum;
+        });
+        ReportBench("vector3_norm", "ns/op", seconds * 1e9 / ((double)vectorLoops * count));
+    }
+    //原点付近の球体に向けて、半分程度が当たる光線を用意する
+    std::vector<Ray> rays;
+    for (int n = 0; n < count; n++)
+    {
+        Vector3 origin = Vector3(random.Next() - 0.5, random.Next() - 0.5, random.Next() - 0.5).Norm() * 5;
+        Vector3 target = Vector3(random.Next() - 0.5, random.Next() - 0.5, random.Next() - 0.5) * 3;
+        rays.push_back(Ray(origin, (target - origin).Norm()));
+    }
+    if (std::string("sphere_ishit").find(filter) != std::string::npos)
+    {
+        Sphere sphere;
+        sphere.Set(Vector3(0, 0, 0), 1, 0);
+        const int loops = 500;
+        int hitCount = 0;
+        double seconds = BestSeconds([&]() {
+            for (int loop = 0; loop < loops; loop++)
+                for (int n = 0; n < count; n++)
+                {
+                    HitRecord hit;
+                    hitCount += sphere.IsHit(rays[n], 1000, hit);
+                }
+            benchSink = hitCount;
+        });
+        ReportBench("sphere_ishit", "ns/intersection", seconds * 1e9 / ((double)loops * count));
+    }
+    if (std::string("triangle_ishit").find(filter) != std::string::npos)
+    {
+        //光線ごとの前計算は葉の三角形全体で共有するので、交差判定だけを測る
+        std::vector<TriangleRay> triangleRays(rays.begin(), rays.end());
+        Vector3 v0(-1.5, -1.5, 0), v1(1.5, -1.5, 0), v2(0, 1.5, 0);
+        const int loops = 500;
+        int hitCount = 0;
+        double seconds = BestSeconds([&]() {
+            for (int loop = 0; loop < loops; loop++)
+                for (int n = 0; n < count; n++)
+                {
+                    Real t;
+                    hitCount += triangleRays[n].Intersect(v0, v1, v2, 0.01, 1000, t);
+                }
+            benchSink = hitCount;
+        });
+        ReportBench("triangle_ishit", "ns/intersection", seconds * 1e9 / ((double)loops * count));
+    }
+    if (std::string("scene_intersect").find(filter) != std::string::npos)
+    {
+        //BenchBVHと同じ配置の球体65536個
+        Scene scene;
+        int material = scene.AddMaterial(Color(1, 1, 1), 0.5, DIFFUSE);
+        const int sphereCount = 65536;
+        float radius = 0.3 / cbrt((double)sphereCount);
+        for (int n = 0; n < sphereCount; n++)
+        {
+            scene.AddSphere(Vector3(random.Next(), random.Next(), random.Next()) * 2 - Vector3(1, 1, 1), radius, material);
+        }
+        scene.Build();
+        const int loops = 20;
+        int hitCount = 0;
+        double seconds = BestSeconds([&]() {
+            for (int loop = 0; loop < loops; loop++)
+                for (int n = 0; n < count; n++)
+                {
+                    HitRecord hit;
+                    hitCount += scene.Intersect(rays[n], hit);
                 }
+            benchSink = hitCount;
+        });
+        ReportBench("scene_intersect", "rays/s", (double)loops * count / seconds);
+    }
+    bool meshBench = std::string("mesh_intersect").find(filter) != std::string::npos;
+    bool instanceBench = std::string("instance_intersect").find(filter) != std::string::npos;
+    if (meshBench || instanceBench)
+    {
+        //半径1の球面を緯度経度で分割した65536面のメッシュ
+        const int rings = 128, segments = 256;
+        std::vector<float> vertices;
+        std::vector<uint32_t> indices;
+        for (int i = 0; i <= rings; i++)
+        {
+            for (int j = 0; j < segments; j++)
+            {
+                double theta = PI * i / rings, phi = 2 * PI * j / segments;
+                vertices.push_back((float)(sin(theta) * cos(phi)));
+                vertices.push_back((float)cos(theta));
+                vertices.push_back((float)(sin(theta) * sin(phi)));
             }
         }
-        //交差がある場合は再帰的に反射させる
-        if (isHit)
+        for (int i = 0; i < rings; i++)
         {
-            //反射した物体のマテリアルを取得
-            Material material = objects[objectIndex].material;
-            //反射したレイを取得
-            Ray secondRay = objects[objectIndex].GetRay(inputRay);
-            //反射回数を+1する
-            secondRay.reflectCount = inputRay.reflectCount + 1;
-            //再帰的に次のレイを飛ばす
-            //return objects[objectIndex].GetNormalRay(inputRay); //法線ベクトルを求める
-            if (inputRay.reflectCount == 0)
+            for (int j = 0; j < segments; j++)
             {
-                return CastRay(secondRay) - (material.color * material.albedo);
+                uint32_t a = i * segments + j, b = i * segments + (j + 1) % segments, c = a + segments, d = b + segments;
+                uint32_t face[6] = {a, c, b, b, c, d};
+                indices.insert(indices.end(), face, face + 6);
             }
-            else
+        }
+        std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>();
+        mesh->Assign(std::move(vertices), std::move(indices));
+        std::shared_ptr<MeshBVH> blas = std::make_shared<MeshBVH>();
+        blas->Build(mesh);
+        if (meshBench)
+        {
+            Scene scene;
+            scene.AddMesh(blas, scene.AddMaterial(Color(1, 1, 1), 0.5, DIFFUSE));
+            scene.Build();
+            const int loops = 20;
+            int hitCount = 0;
+            double seconds = BestSeconds([&]() {
+                for (int loop = 0; loop < loops; loop++)
+                    for (int n = 0; n < count; n++)
+                    {
+                        HitRecord hit;
+                        hitCount += scene.Intersect(rays[n], hit);
+                    }
+                benchSink = hitCount;
+            });
+            ReportBench("mesh_intersect", "rays/s", (double)loops * count / seconds);
+        }
+        if (instanceBench)
+        {
+            //同じメッシュを向きを変えて10×10×10個並べる(展開すれば6553万面になるが、下位BVHは1つだけ)
+            Scene scene;
+            int materialId = scene.AddMaterial(Color(1, 1, 1), 0.5, DIFFUSE);
+            for (int n = 0; n < 1000; n++)
             {
-                return CastRay(secondRay) * material.albedo * material.color;
+                Vector3 position((n % 10 - 4.5) * 0.3, (n / 10 % 10 - 4.5) * 0.3, (n / 100 - 4.5) * 0.3);
+                Vector3 axis(random.Next() - 0.5, random.Next() - 0.5, random.Next() - 0.5);
+                scene.AddMesh(blas, materialId, Transform::Make(position, axis, random.Next() * 360, 0.1));
             }
-
-            //return Color(255, 255, 255); //ぶつかると真っ白
+            scene.Build();
+            const int loops = 10;
+            int hitCount = 0;
+            double seconds = BestSeconds([&]() {
+                for (int loop = 0; loop < loops; loop++)
+                    for (int n = 0; n < count; n++)
+                    {
+                        HitRecord hit;
+                        hitCount += scene.Intersect(rays[n], hit);
+                    }
+                benchSink = hitCount;
+            });
+            ReportBench("instance_intersect", "rays/s", (double)loops * count / seconds);
         }
-        //反射しない場合は背景を写す
-        return BackImage(inputRay);
     }
-    //光線を飛ばして色を取得する
-    Color CastRay(Ray inputRay)
+    bool lookupBench = std::string("environment_lookup").find(filter) != std::string::npos;
+    bool sampleBench = std::string("environment_sample").find(filter) != std::string::npos;
+    if (lookupBench || sampleBench)
     {
-        //すでに8回反射している場合は打ち切り
-        if (inputRay.reflectCount >= MAX_REFLECTSION_SIZE)
+        //1024×512画素の空(太陽の付近だけ明るい)をPFMに書き出して読み込む
+        FrameBuffer sky(1024, 512);
+        for (int y = 0; y < sky.height; y++)
         {
-            Color black(0, 0, 0);
-            return black;
+            for (int x = 0; x < sky.width; x++)
+            {
+                sky.Add(x, y, abs(x - 700) < 8 && abs(y - 150) < 8 ? Color(500, 480, 400) : Color(0.4f, 0.6f, 0.9f));
+            }
         }
-        //一番近い交点を求める
-        double closestT = 1000;
-        int objectIndex;
-        bool isHit = false;
-        //すべてのオブジェクトについて衝突を検索
-        for (int n = 0; n < 4; n++)
+        const char *skyPath = "./bench_sky.tmp.pfm";
+        EnvironmentLight environment;
+        ImageWriter writer;
+        bool loaded = writer.Open(skyPath, FORMAT_PFM, sky.width, sky.height);
+        writer.WriteRows(sky, 0, sky.height, 1.0f, ToneMapper());
+        loaded = writer.Close() && loaded && environment.Load(skyPath);
+        remove(skyPath);
+        //読み込めなければ測らない
+        lookupBench = lookupBench && loaded;
+        sampleBench = sampleBench && loaded;
+        std::vector<Vector3> directions(a);
+        for (int n = 0; n < count; n++)
+        {
+            directions[n].Norm();
+        }
+        const int loops = 500;
+        if (lookupBench)
+        {
+            double seconds = BestSeconds([&]() {
+                float sum = 0;
+                for (int loop = 0; loop < loops; loop++)
+                    for (int n = 0; n < count; n++)
+                        sum += environment.GetColor(directions[n]).r;
+                benchSink = sum;
+            });
+            ReportBench("environment_lookup", "ns/lookup", seconds * 1e9 / ((double)loops * count));
+        }
+        if (sampleBench)
         {
-            //交点が存在する場合
-            if (objects[n].IsHit(inputRay))
+            std::vector<float> numbers(count * 4);
+            for (size_t n = 0; n < numbers.size(); n++)
             {
-                //交点がより近い場合は更新する
-                if (objects[n].solveT1 < closestT)
+                numbers[n] = (float)random.Next();
+            }
+            double seconds = BestSeconds([&]() {
+                float sum = 0;
+                for (int loop = 0; loop < loops; loop++)
+                    for (int n = 0; n < count; n++)
+                    {
+                        const float *r = &numbers[n * 4];
+                        Vector3 direction;
+                        float pdf;
+                        if (environment.Sample(r[0], r[1], r[2], r[3], direction, pdf))
+                            sum += pdf;
+                    }
+                benchSink = sum;
+            });
+            ReportBench("environment_sample", "ns/sample", seconds * 1e9 / ((double)loops * count));
+        }
+    }
+    //素材ごとの反射光線の生成
+    const char *materialNames[] = {"material_getray_diffuse", "material_getray_reflection", "material_getray_refraction"};
+    for (int type = DIFFUSE; type <= REFRACTION; type++)
+    {
+        if (std::string(materialNames[type]).find(filter) == std::string::npos)
+        {
+            continue;
+        }
+        Material material;
+        material.Set(Color(1, 1, 1), 0.5, (reflectionType)type);
+        const int loops = 200;
+        double seconds = BestSeconds([&]() {
+            double sum = 0;
+            for (int loop = 0; loop < loops; loop++)
+                for (int n = 0; n < count; n++)
                 {
-                    closestT = objects[n].solveT1;
-                    objectIndex = n;
-                    isHit = true;
+                    Vector3 N = a[n];
+                    N.Norm();
+                    Vector3 I = b[n];
+                    I.Norm();
+                    sum += material.GetRay(Vector3(0, 0, 0), I, N, false, sampler).direction.x;
                 }
-            }
+            benchSink = sum;
+        });
+        ReportBench(materialNames[type], "ns/op", seconds * 1e9 / ((double)loops * count));
+    }
+    //組み込みのシーン全体を経路追跡する(1スレッド、固定のサンプル数)
+    bool pathsBench = std::string("frame_paths").find(filter) != std::string::npos;
+    bool timeBench = std::string("frame_time").find(filter) != std::string::npos;
+    if (pathsBench || timeBench)
+    {
+        World world;
+        world.LoadBackground();
+        const int spp = 4;
+        double seconds = BestSeconds([&]() {
+            Color sum(0, 0, 0);
+            for (int y = 0; y < world.settings.height; y++)
+                for (int x = 0; x < world.settings.width; x++)
+                    for (int n = 0; n < spp; n++)
+                        sum = sum + world.TraceSample(x, y, n, sampler);
+            benchSink = sum.r + sum.g + sum.b;
+        }, 3);
+        double samples = (double)world.settings.width * world.settings.height * spp;
+        if (pathsBench)
+        {
+            ReportBench("frame_paths", "paths/s", samples / seconds);
         }
-        //交差がある場合は再帰的に反射させる
-        if (isHit)
+        if (timeBench)
         {
-            //反射した物体のマテリアルを取得
-            Material material = objects[objectIndex].material;
-            //反射したレイを取得
-            Ray secondRay = objects[objectIndex].GetRay(inputRay);
-            //反射回数を+1する
-            secondRay.reflectCount = inputRay.reflectCount + 1;
-            //再帰的に次のレイを飛ばす
-            //return objects[objectIndex].GetNormalRay(inputRay); //法線ベクトルを求める
-            return CastRay(secondRay) * material.albedo * material.color;
-            //return Color(255, 255, 255); //ぶつかると真っ白
-        }
-        //反射しない場合は背景を写す
-        return BackImage(inputRay);
-    }
-    Image ReadPPM()
-    {
-        int i, j;       //■ ループ用変数
-        char buff[128]; //■ ヘッダ抽出用
-        int x, y;       //■ 画像ファイルのヘッダ操作用変数
-        FILE *fp;       //■ ファイルポインタ
-
-        /*============================*/
-        /*        画像入力部           */
-        /*============================*/
-        fp = fopen("./backImage.ppm", "rb"); //■ read binaryモードで画像ファイルを開く
-        //■ ファイルの識別符号を読み込み
-        fgets(buff, 128, fp);
-        printf("%s", buff);
-        //■ 画像サイズの読み込み
-        int imageW, imageH;
-        //ピクセル横
-        fscanf(fp, "%s", buff);
-        imageW = atoi(buff);
-        printf("%s\n", buff);
-        //ピクセル縦
-        fscanf(fp, "%s", buff);
-        imageH = atoi(buff);
-        printf("%s\n", buff);
-        //■ 最大輝度値の読み込み
-        fgets(buff, 128, fp);
-        printf("%s", buff);
-
-        //■ 画像データの読み込み
-        unsigned char Pix[imageW][imageH * 3]; //■ バイナリ画像データ格納用
-        for (j = 0; j < imageW; j++)
-            fread(Pix[j], sizeof(unsigned char), imageH * 3, fp);
-        fclose(fp);
+            ReportBench("frame_time", "ms", seconds * 1e3);
+        }
+    }
+    //1920x1080のフレームを各形式で書き出す
+    FrameBuffer frame(1920, 1080);
+    for (size_t n = 0; n < frame.DataSize(); n++)
+    {
+        frame.Data()[n] = (float)random.Next();
+    }
+    const char *formatNames[] = {"output_p3", "output_p6", "output_pfm"};
+    const char *path = "./bench_output.tmp";
+    for (int format = FORMAT_P3; format <= FORMAT_PFM; format++)
+    {
+        if (std::string(formatNames[format]).find(filter) == std::string::npos)
+        {
+            continue;
+        }
+        //書き出せなければ何もしない処理を測ることになるので、結果を出さずにやめる
+        ToneMapper toneMapper;
+        double seconds = HUGE_VAL;
+        for (int n = 0; n < 3 && seconds >= 0; n++)
+        {
+            double run = TimeOutput(frame, (ImageFormat)format, path, toneMapper);
+            seconds = run < 0 ? run : std::min(seconds, run);
+        }
+        if (seconds < 0)
+        {
+            break;
+        }
+        ReportBench(formatNames[format], "Mpixels/s", (double)frame.width * frame.height / seconds / 1e6);
+    }
+    remove(path);
+}
+
+//描画統計の出力先
+struct StatsOutput
+{
+    bool print;           //表を標準エラーに出すか？
+    std::string jsonPath; //JSONを書き出すファイル(空なら書き出さない)
 
-        /*============================*/
-        /*       画像処理部            */
-        /*============================*/
-        Image image(imageW, imageH);
-        for (j = 0; j < imageW; j++)
+    StatsOutput() : print(false) {}
+    void Write() const
+    {
+        if (!print && jsonPath.empty())
+        {
+            return;
+        }
+#if defined(RENDER_STATS)
+        if (print)
         {
-            for (i = 0; i < imageH; i++)
+            renderStats.Print(stderr);
+        }
+        if (!jsonPath.empty())
+        {
+            FILE *fp = fopen(jsonPath.c_str(), "w");
+            if (fp == NULL)
             {
-                //printf("(x,y)=(%d %d)のR値は%dです\n", j, i, Pix[j][3 * i]);
-                //printf("(x,y)=(%d %d)のG値は%dです\n", j, i, Pix[j][3 * i + 1]);
-                //printf("(x,y)=(%d %d)のB値は%dです\n", j, i, Pix[j][3 * i + 2]);
-                Color tmp = Color(Pix[j][3 * i], Pix[j][3 * i + 1], Pix[j][3 * i + 2]);
-                image.SetColor(j, i, tmp);
+                fprintf(stderr, "cannot open %s\n", jsonPath.c_str());
+                return;
             }
+            renderStats.WriteJson(fp);
+            fclose(fp);
         }
-        return image;
+#else
+        fprintf(stderr, "statistics are not compiled in (build with -DRENDER_STATS)\n");
+#endif
     }
 };
 
-int main()
+int main(int argc, char *argv[])
 {
+    //ベンチマーク
+    if (argc >= 2 && std::string(argv[1]) == "--bench-bvh")
+    {
+        BenchBVH();
+        return 0;
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--bench-output")
+    {
+        BenchOutput();
+        return 0;
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--bench-binning")
+    {
+        BenchBinning();
+        return 0;
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--bench-denoise")
+    {
+        BenchDenoise(argc >= 3 ? argv[2] : NULL, argc >= 4 ? atoi(argv[3]) : 256);
+        return 0;
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--bench")
+    {
+        BenchSuite(argc >= 3 ? argv[2] : "");
+        return 0;
+    }
+    //メッシュをバイナリ形式に変換する
+    if (argc == 4 && std::string(argv[1]) == "--convert-mesh")
+    {
+        Timer timer;
+        std::shared_ptr<const Mesh> mesh = LoadMesh(argv[2]);
+        if (mesh == NULL || !mesh->Save(argv[3]))
+        {
+            return 1;
+        }
+        fprintf(stderr, "%s: %d vertices, %d faces, %.3fs\n", argv[3], mesh->vertexCount, mesh->faceCount, timer.Seconds());
+        return 0;
+    }
+    //描画統計の出力先を取り出す(描画オプションではないのでバッチのジョブには渡さない)
+    std::vector<std::string> args;
+    StatsOutput statsOutput;
+    for (int n = 1; n < argc; n++)
+    {
+        std::string arg = argv[n];
+        if (arg == "--stats")
+        {
+            statsOutput.print = true;
+        }
+        else if (arg == "--stats-json" && n + 1 < argc)
+        {
+            statsOutput.jsonPath = argv[++n];
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
+    //バッチ描画
+    if (!args.empty() && args[0] == "--batch")
+    {
+        std::string spoolDir;
+        int jobSlots = RenderThreadCount();
+        for (size_t n = 1; n < args.size(); n++)
+        {
+            if (args[n] == "--jobs" && n + 1 < args.size())
+            {
+                jobSlots = std::max(1, atoi(args[++n].c_str()));
+            }
+            else
+            {
+                spoolDir = args[n];
+            }
+        }
+        BatchServer server(spoolDir, jobSlots);
+        bool ok = server.Run();
+        statsOutput.Write();
+        return ok ? 0 : 1;
+    }
     World world;
-    world.GetImage();
-    return 0;
-}
\ No newline at end of file
+    if (!ParseRenderOptions(args, world))
+    {
+        fprintf(stderr, "usage: %s [--scene FILE] [--camera EX EY EZ LX LY LZ ANGLE] [--size W H] [--threads N] [--depth N] [--spp N]\n"
+                        "          [--output FILE(.ppm|.pfm)] [--ascii] [--stream] [--morton] [--wavefront [--bin-rays]] [--no-light-sampling] [--back FILE(.ppm|.pfm)]\n"
+                        "          [--progressive [--snapshot-passes N] [--snapshot-seconds T]] [--adaptive [--threshold E] [--min-spp N]]\n"
+                        "          [--aov beauty|normal|depth|albedo|outline|second|disparity FILE(.ppm|.pfm)]... [--denoise]\n"
+                        "          [--stats] [--stats-json FILE]\n"
+                        "          | --batch [SPOOL_DIR] [--jobs N] | --bench [NAME] | --bench-bvh | --bench-output | --bench-binning\n"
+                        "          | --bench-denoise [SCENE [REFERENCE_SPP]]\n"
+                        "          | --convert-mesh IN(.obj) OUT\n",
+                argv[0]);
+        return 1;
+    }
+    bool ok = world.GetImage();
+    statsOutput.Write();
+    return ok ? 0 : 1;
+}